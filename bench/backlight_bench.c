@@ -0,0 +1,323 @@
+#include <systemd/sd-bus.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+
+/*
+ * Backlight transitions benchmark.
+ * It drives a running clightd through SetAll, then:
+ * - tracks every Brightness PropertiesChanged emitted by backlight devices objects,
+ *   ie: every value actually written, to compute fade completion time, writes issued and per-step jitter
+ * - keeps pinging clightd (getting its Version property) to measure how long its main loop is blocked.
+ * With -r N, it instead checks that N back-to-back RaiseAll requests are all applied,
+ * even when they are received while ddc displays are still being held (ie: opened and read):
+ * every device must end at low pct + N * delta.
+ * Build clightd with -DENABLE_FAKE_DDC=ON to run it without any physical monitor, eg:
+ *   # FAKE_DDC_DISPLAYS="40:50:0,40:50:0,60:80:5" ./clightd
+ *   # ./backlight_bench -s 0.05 -w 30 -n 4
+ *   # ./backlight_bench -L 0.2 -r 5 -D 0.1
+ * SetAll requires polkit authorization: run it as root.
+ */
+
+#define MAX_DEVICES 32
+#define PING_INTERVAL_MS 5
+#define IDLE_TIMEOUT_MS 1500
+
+typedef struct {
+    char path[256];
+    uint64_t last_ts;
+    double last_pct;
+    unsigned long writes;
+    double sum_intervals;
+    double sum_sq_intervals;
+} bench_device;
+
+typedef struct {
+    unsigned long count;
+    double sum;
+    double max;
+} ping_stats;
+
+static uint64_t now_us(void);
+static void parse_opts(int argc, char *argv[]);
+static int on_properties_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int on_ping_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int send_ping(void);
+static int run_iteration(const double target);
+static int wait_idle(void);
+static int run_raise_test(void);
+static void print_results(const double target, const uint64_t elapsed);
+
+static const char bus_name[] = "org.clightd.clightd";
+static const char bl_path[] = "/org/clightd/clightd/Backlight";
+static const char bl_interface[] = "org.clightd.clightd.Backlight";
+
+static sd_bus *bus;
+static bench_device devices[MAX_DEVICES];
+static int num_devices;
+static ping_stats pings;
+static uint64_t start_ts, ping_ts, last_event_ts;
+static int ping_in_flight;
+
+static double high = 1.0, low = 0.0, step = 0.05, delta = 0.1;
+static unsigned int wait_ms = 30, duration_ms = 0;
+static int iterations = 4, raises = 0;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void parse_opts(int argc, char *argv[]) {
+    static const struct option opts[] = {
+        { "high", required_argument, NULL, 'H' },
+        { "low", required_argument, NULL, 'L' },
+        { "step", required_argument, NULL, 's' },
+        { "wait", required_argument, NULL, 'w' },
+        { "duration", required_argument, NULL, 'd' },
+        { "iterations", required_argument, NULL, 'n' },
+        { "raise", required_argument, NULL, 'r' },
+        { "delta", required_argument, NULL, 'D' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "H:L:s:w:d:n:r:D:h", opts, NULL)) != -1) {
+        switch (c) {
+            case 'H':
+                high = atof(optarg);
+                break;
+            case 'L':
+                low = atof(optarg);
+                break;
+            case 's':
+                step = atof(optarg);
+                break;
+            case 'w':
+                wait_ms = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                duration_ms = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 'r':
+                raises = atoi(optarg);
+                break;
+            case 'D':
+                delta = atof(optarg);
+                break;
+            default:
+                printf("Usage: %s [-H high pct] [-L low pct] [-s step] [-w wait ms] [-d duration ms] [-n iterations] [-r raises] [-D delta]\n", argv[0]);
+                printf("Fades alternate between high and low pct; a duration switches to duration based transitions.\n");
+                printf("A number of raises runs the RaiseAll accumulation check instead, starting from low pct.\n");
+                exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+}
+
+static int on_properties_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    const char *path = sd_bus_message_get_path(m);
+    const char *iface = NULL;
+    double pct = -1.0;
+    int has_brightness = 0;
+
+    sd_bus_message_read(m, "s", &iface);
+    if (sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "{sv}") > 0) {
+        while (sd_bus_message_enter_container(m, SD_BUS_TYPE_DICT_ENTRY, "sv") > 0) {
+            const char *prop = NULL;
+            sd_bus_message_read(m, "s", &prop);
+            if (!strcmp(prop, "Brightness")) {
+                has_brightness = sd_bus_message_read(m, "v", "d", &pct) >= 0;
+            } else {
+                sd_bus_message_skip(m, "v");
+            }
+            sd_bus_message_exit_container(m);
+        }
+        sd_bus_message_exit_container(m);
+    }
+    /* Other properties (eg: WriteLatency) changes are not brightness writes */
+    if (!has_brightness) {
+        return 0;
+    }
+
+    bench_device *d = NULL;
+    for (int i = 0; i < num_devices && !d; i++) {
+        if (!strcmp(devices[i].path, path)) {
+            d = &devices[i];
+        }
+    }
+    if (!d && num_devices < MAX_DEVICES) {
+        d = &devices[num_devices++];
+        strncpy(d->path, path, sizeof(d->path) - 1);
+    }
+
+    if (d) {
+        const uint64_t ts = now_us();
+        if (d->writes > 0) {
+            const double interval = (ts - d->last_ts) / 1000.0;
+            d->sum_intervals += interval;
+            d->sum_sq_intervals += interval * interval;
+        }
+        d->writes++;
+        d->last_ts = ts;
+        d->last_pct = pct;
+        last_event_ts = ts;
+    }
+    return 0;
+}
+
+static int on_ping_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    const double latency = (now_us() - ping_ts) / 1000.0;
+    pings.count++;
+    pings.sum += latency;
+    if (latency > pings.max) {
+        pings.max = latency;
+    }
+    ping_in_flight = 0;
+    return 0;
+}
+
+static int send_ping(void) {
+    ping_ts = now_us();
+    ping_in_flight = 1;
+    return sd_bus_call_method_async(bus, NULL, bus_name, "/org/clightd/clightd",
+                                    "org.freedesktop.DBus.Properties", "Get",
+                                    on_ping_reply, NULL, "ss", bus_name, "Version");
+}
+
+static int run_iteration(const double target) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+
+    memset(devices, 0, sizeof(devices));
+    num_devices = 0;
+    memset(&pings, 0, sizeof(pings));
+
+    start_ts = last_event_ts = now_us();
+    const int is_smooth = step > 0 || duration_ms > 0;
+    int r = sd_bus_call_method(bus, bus_name, bl_path, bl_interface, "SetAll", &error, &reply,
+                               "d(bdu)s", target, is_smooth, duration_ms ? 0.0 : step,
+                               duration_ms ? duration_ms : wait_ms, "");
+    if (r < 0) {
+        fprintf(stderr, "SetAll failed: %s\n", error.message ? error.message : strerror(-r));
+        sd_bus_error_free(&error);
+        return r;
+    }
+    sd_bus_message_unref(reply);
+
+    r = wait_idle();
+    if (r >= 0) {
+        print_results(target, last_event_ts - start_ts);
+    }
+    return r;
+}
+
+/* Run until no Brightness change is received for IDLE_TIMEOUT_MS */
+static int wait_idle(void) {
+    int r = 0;
+    while (now_us() - last_event_ts < IDLE_TIMEOUT_MS * 1000) {
+        if (!ping_in_flight && now_us() - ping_ts >= PING_INTERVAL_MS * 1000) {
+            send_ping();
+        }
+        do {
+            r = sd_bus_process(bus, NULL);
+        } while (r > 0);
+        if (r < 0) {
+            fprintf(stderr, "Failed to process bus: %s\n", strerror(-r));
+            return r;
+        }
+        sd_bus_wait(bus, PING_INTERVAL_MS * 1000);
+    }
+    return 0;
+}
+
+/* 
+ * Send raises RaiseAll back to back, without waiting for their replies:
+ * those received while a transition is still holding its display must be accumulated, not dropped.
+ */
+static int run_raise_test(void) {
+    int r = run_iteration(low);
+    if (r < 0) {
+        return r;
+    }
+
+    memset(devices, 0, sizeof(devices));
+    num_devices = 0;
+    start_ts = last_event_ts = now_us();
+    const int is_smooth = step > 0 || duration_ms > 0;
+    for (int i = 0; i < raises && r >= 0; i++) {
+        r = sd_bus_call_method_async(bus, NULL, bus_name, bl_path, bl_interface, "RaiseAll", NULL, NULL,
+                                     "d(bdu)s", delta, is_smooth, duration_ms ? 0.0 : step,
+                                     duration_ms ? duration_ms : wait_ms, "");
+    }
+    if (r < 0) {
+        fprintf(stderr, "RaiseAll failed: %s\n", strerror(-r));
+        return r;
+    }
+    r = wait_idle();
+    if (r < 0) {
+        return r;
+    }
+
+    const double expected = fmin(low + raises * delta, 1.0);
+    int failed = num_devices == 0;
+    printf("%d raises of %.2lf from %.2lf: expecting %.3lf\n", raises, delta, low, expected);
+    for (int i = 0; i < num_devices; i++) {
+        bench_device *d = &devices[i];
+        /* Allow for a quantization step on displays with a small max brightness */
+        const int ok = fabs(d->last_pct - expected) <= 0.02;
+        printf("  %s: reached %.3lf in %lu writes: %s\n", strrchr(d->path, '/') + 1, 
+               d->last_pct, d->writes, ok ? "OK" : "FAILED");
+        failed |= !ok;
+    }
+    return failed ? -EINVAL : 0;
+}
+
+static void print_results(const double target, const uint64_t elapsed) {
+    printf("Fade to %.2lf: completed in %.1lf ms\n", target, elapsed / 1000.0);
+    for (int i = 0; i < num_devices; i++) {
+        bench_device *d = &devices[i];
+        const unsigned long n = d->writes > 1 ? d->writes - 1 : 1;
+        const double mean = d->sum_intervals / n;
+        const double jitter = sqrt(fabs(d->sum_sq_intervals / n - mean * mean));
+        printf("  %s: %lu writes, completed in %.1lf ms, reached %.3lf, step interval %.1lf ms (jitter %.1lf ms)\n",
+               strrchr(d->path, '/') + 1, d->writes, (d->last_ts - start_ts) / 1000.0,
+               d->last_pct, mean, jitter);
+    }
+    printf("  main loop blocking: %lu pings, avg %.2lf ms, max %.2lf ms\n",
+           pings.count, pings.count ? pings.sum / pings.count : 0.0, pings.max);
+}
+
+int main(int argc, char *argv[]) {
+    parse_opts(argc, argv);
+
+    int r = sd_bus_default_system(&bus);
+    if (r < 0) {
+        fprintf(stderr, "Failed to connect to system bus: %s\n", strerror(-r));
+        return EXIT_FAILURE;
+    }
+
+    r = sd_bus_add_match(bus, NULL,
+                         "type='signal',"
+                         "sender='org.clightd.clightd',"
+                         "interface='org.freedesktop.DBus.Properties',"
+                         "member='PropertiesChanged',"
+                         "path_namespace='/org/clightd/clightd/Backlight'",
+                         on_properties_changed, NULL);
+    if (r >= 0 && raises > 0) {
+        r = run_raise_test();
+    }
+    for (int i = 0; i < iterations && r >= 0 && raises == 0; i++) {
+        r = run_iteration(i % 2 ? low : high);
+    }
+    sd_bus_flush_close_unref(bus);
+    return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+/*
+ * Subset of ddcutil 0.9.x C API used by clightd, implemented by fake_ddcutil.c.
+ * Only meant to be used by ENABLE_FAKE_DDC builds, to benchmark backlight module.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef int DDCA_Status;
+typedef uint8_t DDCA_Vcp_Feature_Code;
+typedef void *DDCA_Display_Identifier;
+typedef void *DDCA_Display_Ref;
+typedef void *DDCA_Display_Handle;
+
+#define DDCRC_OK                  0
+#define DDCRC_DDC_DATA        -3001
+#define DDCRC_ARG             -3013
+#define DDCRC_INVALID_DISPLAY -3020
+#define DDCRC_VERIFY          -3022
+#define DDCRC_LOCKED          -3027
+
+typedef enum { 
+    DDCA_IO_I2C, 
+    DDCA_IO_ADL, 
+    DDCA_IO_USB 
+} DDCA_IO_Mode;
+
+typedef struct {
+    int iAdapterIndex;
+    int iDisplayIndex;
+} DDCA_Adlno;
+
+typedef struct {
+    DDCA_IO_Mode io_mode;
+    union {
+        int i2c_busno;
+        DDCA_Adlno adlno;
+        int hiddev_devno;
+    } path;
+} DDCA_IO_Path;
+
+typedef struct {
+    char marker[4];
+    int dispno;
+    DDCA_IO_Path path;
+    int usb_bus;
+    int usb_device;
+    char mfg_id[4];
+    char model_name[14];
+    char sn[14];
+    uint16_t product_code;
+    uint8_t edid_bytes[128];
+    DDCA_Display_Ref dref;
+} DDCA_Display_Info;
+
+typedef struct {
+    int ct;
+    DDCA_Display_Info info[];
+} DDCA_Display_Info_List;
+
+typedef enum { 
+    DDCA_NON_TABLE_VCP_VALUE = 1, 
+    DDCA_TABLE_VCP_VALUE = 2 
+} DDCA_Vcp_Value_Type;
+
+typedef struct {
+    DDCA_Vcp_Feature_Code opcode;
+    DDCA_Vcp_Value_Type value_type;
+    union {
+        struct {
+            uint8_t *bytes;
+            uint16_t bytect;
+        } t;
+        struct {
+            uint8_t mh;
+            uint8_t ml;
+            uint8_t sh;
+            uint8_t sl;
+        } c_nc;
+    } val;
+} DDCA_Any_Vcp_Value;
+
+#define VALREC_CUR_VAL(valrec) ( (valrec)->val.c_nc.sh << 8 | (valrec)->val.c_nc.sl )
+#define VALREC_MAX_VAL(valrec) ( (valrec)->val.c_nc.mh << 8 | (valrec)->val.c_nc.ml )
+
+DDCA_Status ddca_get_display_info_list2(bool include_invalid_displays, DDCA_Display_Info_List **dlist_loc);
+void ddca_free_display_info_list(DDCA_Display_Info_List *dlist);
+DDCA_Status ddca_open_display2(DDCA_Display_Ref ddca_dref, bool wait, DDCA_Display_Handle *ddca_dh_loc);
+DDCA_Status ddca_close_display(DDCA_Display_Handle ddca_dh);
+DDCA_Status ddca_get_any_vcp_value_using_explicit_type(DDCA_Display_Handle ddca_dh, DDCA_Vcp_Feature_Code feature_code, 
+                                                       DDCA_Vcp_Value_Type call_type, DDCA_Any_Vcp_Value **pvalrec);
+void ddca_free_any_vcp_value(DDCA_Any_Vcp_Value *valrec);
+DDCA_Status ddca_set_non_table_vcp_value(DDCA_Display_Handle ddca_dh, DDCA_Vcp_Feature_Code feature_code, 
+                                         uint8_t hi_byte, uint8_t lo_byte);
+DDCA_Status ddca_create_busno_display_identifier(int busno, DDCA_Display_Identifier *did_loc);
+DDCA_Status ddca_create_usb_hiddev_display_identifier(int hiddev_devno, DDCA_Display_Identifier *did_loc);
+DDCA_Status ddca_create_adlno_display_identifier(int iAdapterIndex, int iDisplayIndex, DDCA_Display_Identifier *did_loc);
+DDCA_Status ddca_create_mfg_model_sn_display_identifier(const char *mfg_id, const char *model, const char *sn, 
+                                                        DDCA_Display_Identifier *did_loc);
+DDCA_Status ddca_get_display_ref(DDCA_Display_Identifier did, DDCA_Display_Ref *dref_loc);
+DDCA_Status ddca_free_display_identifier(DDCA_Display_Identifier did);
+double ddca_set_sleep_multiplier(double multiplier);
+double ddca_get_sleep_multiplier(void);
+bool ddca_enable_verify(bool onoff);
+bool ddca_is_verify_enabled(void);
@@ -0,0 +1,283 @@
+#include <ddcutil_c_api.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+/*
+ * Latency-simulating ddcutil stand-in.
+ * Displays are configured through FAKE_DDC_DISPLAYS env variable, as a comma separated list of
+ * "read_ms:write_ms:fail_pct[:min_sleep]" entries, one per display; eg: "40:50:0,40:50:0,60:80:5:0.4".
+ * Default is a single display with 40ms read latency, 50ms write latency and no failures.
+ * Latencies are scaled by calling thread sleep multiplier, like ddcutil inter-command sleeps;
+ * writes issued with a multiplier lower than min_sleep are silently dropped (or fail, when verified).
+ * Display i is exposed on /dev/i2c-$i with "FAKE$i" serial number; its max brightness is 100.
+ * Per-display stats are printed to stderr on exit.
+ */
+
+#define FAKE_MAX_DISPLAYS 16
+
+typedef struct {
+    int idx;
+    unsigned int read_ms;
+    unsigned int write_ms;
+    unsigned int fail_pct;
+    double min_sleep;           // lowest reliable sleep multiplier
+    uint16_t curr;
+    uint16_t max;
+    bool open;
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long failures;
+    pthread_mutex_t mtx;        // serializes transactions, like a real i2c bus
+} fake_display;
+
+typedef struct {
+    int busno;                  // -1 if identified by sn
+    char sn[14];
+} fake_identifier;
+
+static void init_fake_displays(void);
+static void print_fake_stats(void);
+static DDCA_Status fake_transaction(fake_display *d, const unsigned int ms);
+static DDCA_Status new_identifier(const int busno, const char *sn, DDCA_Display_Identifier *did_loc);
+static void sleep_ms(const unsigned int ms);
+
+static fake_display displays[FAKE_MAX_DISPLAYS];
+static int num_displays;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t rand_mtx = PTHREAD_MUTEX_INITIALIZER;
+static __thread double sleep_multiplier = 1.0;
+static __thread bool verify;
+
+static void init_fake_displays(void) {
+    const char *conf = getenv("FAKE_DDC_DISPLAYS");
+    if (!conf || !strlen(conf)) {
+        conf = "40:50:0";
+    }
+    
+    char *str = strdup(conf);
+    char *saveptr = NULL;
+    for (char *tok = strtok_r(str, ",", &saveptr); tok && num_displays < FAKE_MAX_DISPLAYS; 
+         tok = strtok_r(NULL, ",", &saveptr)) {
+        
+        fake_display *d = &displays[num_displays];
+        if (sscanf(tok, "%u:%u:%u:%lf", &d->read_ms, &d->write_ms, &d->fail_pct, &d->min_sleep) < 3) {
+            fprintf(stderr, "fake_ddcutil: wrong display config '%s'.\n", tok);
+            continue;
+        }
+        d->idx = num_displays++;
+        d->max = 100;
+        d->curr = 50;
+        pthread_mutex_init(&d->mtx, NULL);
+    }
+    free(str);
+    srand(time(NULL));
+    atexit(print_fake_stats);
+}
+
+static void print_fake_stats(void) {
+    for (int i = 0; i < num_displays; i++) {
+        fprintf(stderr, "fake_ddcutil: FAKE%d: %lu reads, %lu writes, %lu failures.\n", 
+                i, displays[i].reads, displays[i].writes, displays[i].failures);
+    }
+}
+
+/* Called with d->mtx held */
+static DDCA_Status fake_transaction(fake_display *d, const unsigned int ms) {
+    sleep_ms(ms * sleep_multiplier);
+    pthread_mutex_lock(&rand_mtx);
+    const bool fail = (unsigned int)(rand() % 100) < d->fail_pct;
+    pthread_mutex_unlock(&rand_mtx);
+    if (fail) {
+        d->failures++;
+        return DDCRC_DDC_DATA;
+    }
+    return DDCRC_OK;
+}
+
+static void sleep_ms(const unsigned int ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) == -1);
+}
+
+DDCA_Status ddca_get_display_info_list2(bool include_invalid_displays, DDCA_Display_Info_List **dlist_loc) {
+    pthread_once(&init_once, init_fake_displays);
+    
+    DDCA_Display_Info_List *dlist = calloc(1, sizeof(DDCA_Display_Info_List) + num_displays * sizeof(DDCA_Display_Info));
+    if (!dlist) {
+        return -ENOMEM;
+    }
+    dlist->ct = num_displays;
+    for (int i = 0; i < num_displays; i++) {
+        DDCA_Display_Info *info = &dlist->info[i];
+        memcpy(info->marker, "DDIN", 4);
+        info->dispno = i + 1;
+        info->path.io_mode = DDCA_IO_I2C;
+        info->path.path.i2c_busno = i;
+        strcpy(info->mfg_id, "FAK");
+        snprintf(info->model_name, sizeof(info->model_name), "Fake monitor");
+        snprintf(info->sn, sizeof(info->sn), "FAKE%hhu", (uint8_t)i);
+        info->dref = &displays[i];
+    }
+    *dlist_loc = dlist;
+    return DDCRC_OK;
+}
+
+void ddca_free_display_info_list(DDCA_Display_Info_List *dlist) {
+    free(dlist);
+}
+
+DDCA_Status ddca_open_display2(DDCA_Display_Ref ddca_dref, bool wait, DDCA_Display_Handle *ddca_dh_loc) {
+    fake_display *d = (fake_display *)ddca_dref;
+    if (!d) {
+        return DDCRC_ARG;
+    }
+    
+    DDCA_Status rc = DDCRC_LOCKED;
+    pthread_mutex_lock(&d->mtx);
+    if (!d->open) {
+        d->open = true;
+        *ddca_dh_loc = d;
+        rc = DDCRC_OK;
+    }
+    pthread_mutex_unlock(&d->mtx);
+    return rc;
+}
+
+DDCA_Status ddca_close_display(DDCA_Display_Handle ddca_dh) {
+    fake_display *d = (fake_display *)ddca_dh;
+    if (!d) {
+        return DDCRC_ARG;
+    }
+    pthread_mutex_lock(&d->mtx);
+    d->open = false;
+    pthread_mutex_unlock(&d->mtx);
+    return DDCRC_OK;
+}
+
+DDCA_Status ddca_get_any_vcp_value_using_explicit_type(DDCA_Display_Handle ddca_dh, DDCA_Vcp_Feature_Code feature_code, 
+                                                       DDCA_Vcp_Value_Type call_type, DDCA_Any_Vcp_Value **pvalrec) {
+    fake_display *d = (fake_display *)ddca_dh;
+    if (!d || call_type != DDCA_NON_TABLE_VCP_VALUE) {
+        return DDCRC_ARG;
+    }
+    
+    pthread_mutex_lock(&d->mtx);
+    d->reads++;
+    DDCA_Status rc = fake_transaction(d, d->read_ms);
+    if (rc == DDCRC_OK) {
+        DDCA_Any_Vcp_Value *valrec = calloc(1, sizeof(DDCA_Any_Vcp_Value));
+        valrec->opcode = feature_code;
+        valrec->value_type = DDCA_NON_TABLE_VCP_VALUE;
+        valrec->val.c_nc.mh = d->max >> 8;
+        valrec->val.c_nc.ml = d->max & 0xff;
+        valrec->val.c_nc.sh = d->curr >> 8;
+        valrec->val.c_nc.sl = d->curr & 0xff;
+        *pvalrec = valrec;
+    }
+    pthread_mutex_unlock(&d->mtx);
+    return rc;
+}
+
+void ddca_free_any_vcp_value(DDCA_Any_Vcp_Value *valrec) {
+    free(valrec);
+}
+
+DDCA_Status ddca_set_non_table_vcp_value(DDCA_Display_Handle ddca_dh, DDCA_Vcp_Feature_Code feature_code, 
+                                         uint8_t hi_byte, uint8_t lo_byte) {
+    fake_display *d = (fake_display *)ddca_dh;
+    if (!d) {
+        return DDCRC_ARG;
+    }
+    
+    pthread_mutex_lock(&d->mtx);
+    d->writes++;
+    DDCA_Status rc = fake_transaction(d, d->write_ms);
+    if (rc == DDCRC_OK && sleep_multiplier < d->min_sleep) {
+        /* Display did not have time to process the command */
+        d->failures++;
+        if (verify) {
+            rc = DDCRC_VERIFY;
+        }
+    } else if (rc == DDCRC_OK) {
+        const uint16_t val = hi_byte << 8 | lo_byte;
+        d->curr = val > d->max ? d->max : val;
+    }
+    pthread_mutex_unlock(&d->mtx);
+    return rc;
+}
+
+static DDCA_Status new_identifier(const int busno, const char *sn, DDCA_Display_Identifier *did_loc) {
+    fake_identifier *id = calloc(1, sizeof(fake_identifier));
+    if (!id) {
+        return -ENOMEM;
+    }
+    id->busno = busno;
+    if (sn) {
+        strncpy(id->sn, sn, sizeof(id->sn) - 1);
+    }
+    *did_loc = id;
+    return DDCRC_OK;
+}
+
+DDCA_Status ddca_create_busno_display_identifier(int busno, DDCA_Display_Identifier *did_loc) {
+    return new_identifier(busno, NULL, did_loc);
+}
+
+DDCA_Status ddca_create_usb_hiddev_display_identifier(int hiddev_devno, DDCA_Display_Identifier *did_loc) {
+    return DDCRC_INVALID_DISPLAY;
+}
+
+DDCA_Status ddca_create_adlno_display_identifier(int iAdapterIndex, int iDisplayIndex, DDCA_Display_Identifier *did_loc) {
+    return DDCRC_INVALID_DISPLAY;
+}
+
+DDCA_Status ddca_create_mfg_model_sn_display_identifier(const char *mfg_id, const char *model, const char *sn, 
+                                                        DDCA_Display_Identifier *did_loc) {
+    return new_identifier(-1, sn, did_loc);
+}
+
+DDCA_Status ddca_get_display_ref(DDCA_Display_Identifier did, DDCA_Display_Ref *dref_loc) {
+    pthread_once(&init_once, init_fake_displays);
+    
+    fake_identifier *id = (fake_identifier *)did;
+    int idx = id->busno;
+    if (idx == -1 && sscanf(id->sn, "FAKE%d", &idx) != 1) {
+        return DDCRC_INVALID_DISPLAY;
+    }
+    if (idx < 0 || idx >= num_displays) {
+        return DDCRC_INVALID_DISPLAY;
+    }
+    *dref_loc = &displays[idx];
+    return DDCRC_OK;
+}
+
+DDCA_Status ddca_free_display_identifier(DDCA_Display_Identifier did) {
+    free(did);
+    return DDCRC_OK;
+}
+
+double ddca_set_sleep_multiplier(double multiplier) {
+    const double old = sleep_multiplier;
+    if (multiplier >= 0.0 && multiplier <= 10.0) {
+        sleep_multiplier = multiplier;
+    }
+    return old;
+}
+
+double ddca_get_sleep_multiplier(void) {
+    return sleep_multiplier;
+}
+
+bool ddca_enable_verify(bool onoff) {
+    const bool old = verify;
+    verify = onoff;
+    return old;
+}
+
+bool ddca_is_verify_enabled(void) {
+    return verify;
+}
@@ -7,6 +7,7 @@
 #include <systemd/sd-bus.h>
 #include <libudev.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <sys/timerfd.h>
 #include <module/modules_easy.h>
 #include <module/module_easy.h>
@@ -19,5 +20,31 @@ typedef struct module {
     int (*poll_cb)(const int fd);         // module poll callback
 } module_t;
 
+/* 
+ * Daemon-wide timers: every deadline is kept in a single min-heap,
+ * served by one timerfd owned by TIMER module (modules/timer.c).
+ * Deadlines expiring close together are fired in the same wakeup.
+ */
+typedef struct _deadline {
+    uint64_t expiry;                        // absolute CLOCK_MONOTONIC expiry time, in us
+    uint64_t gen;                           // dispatch generation when it was set
+    int idx;                                // position in timers heap; -1 if not armed
+    void (*cb)(struct _deadline *d);        // called from main loop when deadline expires
+    void *userdata;
+} deadline_t;
+
+void deadline_init(deadline_t *d, void (*cb)(deadline_t *d), void *userdata);
+void deadline_set(deadline_t *d, const uint64_t ms);
+void deadline_cancel(deadline_t *d);
+uint64_t deadline_remaining(const deadline_t *d);
+
+/* Daemon configuration, set through cmdline options */
+typedef struct {
+    unsigned int ddc_cache_ttl;             // ms a cached external monitor brightness is served to getters
+    unsigned int polkit_cache_ttl;          // ms a positive polkit authorization is cached; 0 to disable cache
+} conf_t;
+
+extern conf_t conf;
+
 sd_bus *bus;
 struct udev *udev;
@@ -25,6 +25,11 @@
 
 static const char bus_interface[] = "org.clightd.clightd";
 
+conf_t conf = {
+    .ddc_cache_ttl = 3000,
+    .polkit_cache_ttl = 5000,
+};
+
 /* Every module needs these; let's init them before any module */
 void modules_pre_start(void) {
     udev = udev_new();
@@ -39,6 +44,12 @@ static void check_opts(int argc, char *argv[]) {
             printf("* Copyright (C) 2019  Federico Di Pierro <nierro92@gmail.com>\n");
             exit(EXIT_SUCCESS);
         }
+        if (!strcmp(argv[i], "--ddc-cache-ttl") && i + 1 < argc) {
+            conf.ddc_cache_ttl = strtoul(argv[++i], NULL, 10);
+        }
+        if (!strcmp(argv[i], "--polkit-cache-ttl") && i + 1 < argc) {
+            conf.polkit_cache_ttl = strtoul(argv[++i], NULL, 10);
+        }
     }
 }
 
@@ -1,61 +1,153 @@
 #include <commons.h>
 #include <module/map.h>
 #include <polkit.h>
+#include <stats.h>
+#include <usdt.h>
+#include <lazy.h>
+#include <coalesce.h>
 #include <udev.h>
+#include <sensor.h>
+#include <math.h>
+#include <fcntl.h>
+#include <linux/limits.h>
 
 #ifdef DDC_PRESENT
 
 #include <ddcutil_c_api.h>
+#include <pthread.h>
+#include <worker.h>
+#include <sys/stat.h>
 
-#define DDCUTIL_LOOP(func) \
-    const DDCA_Vcp_Feature_Code br_code = 0x10; \
-    DDCA_Display_Info_List *dlist = NULL; \
-    ddca_get_display_info_list2(false, &dlist); \
-    if (dlist) { \
-        for (int ndx = 0; ndx < dlist->ct; ndx++) { \
-            DDCA_Display_Info *dinfo = &dlist->info[ndx]; \
-            DDCA_Display_Ref dref = dinfo->dref; \
-            DDCA_Display_Handle dh = NULL; \
-            if (ddca_open_display2(dref, false, &dh)) { \
-                continue; \
-            } \
-            DDCA_Any_Vcp_Value *valrec; \
-            if (!ddca_get_any_vcp_value_using_explicit_type(dh, br_code, DDCA_NON_TABLE_VCP_VALUE, &valrec)) { \
-                char id[32]; \
-                get_info_id(id, sizeof(id), dinfo); \
-                func; \
-                ddca_free_any_vcp_value(valrec); \
-            } \
-            ddca_close_display(dh); \
+typedef struct {
+    char id[32];                // display uid, as returned by get_info_id()
+    DDCA_Display_Ref dref;
+    uint16_t max;               // cached max brightness VCP value
+    int busno;                  // i2c bus number; -1 if display is not on i2c
+    char ddcci[32];             // sysname of ddcci kernel driver backlight driving this display, if any
+    double sleep_mult;          // ddcutil sleep multiplier used for this display
+    double good_mult;           // lowest sleep multiplier known to be reliable
+    int verified;               // verified writes with current sleep_mult, while tuning
+    bool tuned;                 // whether sleep_mult is tuned (or was loaded from state file)
+    unsigned int writes;        // writes issued once tuned
+} ddc_display;
+
+/* 
+ * Sleep multipliers are tuned by halving them every DDC_PROBE_WRITES verified writes,
+ * down to DDC_MIN_SLEEP_MULT, then stored in ddc_state_file.
+ * Once tuned, one write every DDC_SAMPLE_WRITES is still verified, to catch dropped writes.
+ */
+#define DDC_PROBE_WRITES 3
+#define DDC_SAMPLE_WRITES 8
+#define DDC_MIN_SLEEP_MULT 0.1
+
+static const DDCA_Vcp_Feature_Code br_code = 0x10;
+static const char ddc_state_dir[] = "/var/lib/clightd";
+static const char ddc_state_file[] = "/var/lib/clightd/ddc_sleep_multipliers";
+static ddc_display *ddc_displays;
+static int num_ddc_displays;
+static int drm_mon_handler = -1, i2c_mon_handler = -1;
+static int drm_mon_fd = -1, i2c_mon_fd = -1;
+
+typedef enum { DDC_HOLD, DDC_READ, DDC_WRITE, DDC_RELEASE } ddc_op_type;
+
+/* 
+ * A ddc operation, run on a ddc worker thread.
+ * Workers only ever touch the op itself: result is consumed by cb, from main loop.
+ */
+typedef struct _ddc_op {
+    ddc_op_type type;
+    char id[32];                // display id; ops on same id are serialized on same worker
+    DDCA_Display_Ref dref;      // registry display ref, if known
+    uint16_t val;               // value to be written, or value read
+    uint16_t max;
+    DDCA_Status rc;
+    double sleep_mult;          // ddcutil sleep multiplier to be used
+    bool verify;                // whether write has to be verified
+    unsigned int write_ms;      // how long a write took, in ms
+    void (*cb)(struct _ddc_op *op);
+    void *ctx;
+} ddc_op;
+
+/* Open display handle, shared by all ops on the same display */
+typedef struct {
+    DDCA_Display_Handle dh;
+    int holders;
+} ddc_handle;
+
+static const int num_ddc_workers = 4;
+static worker_pool_t *ddc_pool;
+static map_t *ddc_handles;      // display id -> ddc_handle; only accessed by ddc workers
+static pthread_mutex_t handles_mtx = PTHREAD_MUTEX_INITIALIZER;
+/* 
+ * Ddcutil detection is not safe alongside any other ddcutil call: 
+ * ops share this lock (run in parallel), detection takes it exclusively.
+ * Writers are preferred, for a stream of ops not to starve detection.
+ */
+static pthread_rwlock_t ddc_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static map_t *ddc_sleep_mults;  // id -> stored sleep multiplier; only touched from main loop
+
+/* 
+ * A ddc displays detection, run by a ddc worker.
+ * Worker only uses its copy of the registry; result is published by on_ddc_detected().
+ */
+typedef struct {
+    ddc_display *known;         // registry when detection started: known displays are not probed again
+    int num_known;
+    ddc_display *displays;      // detected displays
+    int *curr;                  // brightness of newly probed displays; -1 for known ones
+    int num_displays;
+} ddc_detection;
+
+/* SetAll issued while detection was in progress: it is applied to newly detected displays too */
+typedef struct {
+    double target_pct;
+    int is_smooth;
+    double smooth_step;
+    unsigned int smooth_wait;
+    int verse;
+    bool valid;
+} ddc_deferred_set;
+
+static ddc_detection *detection;        // in progress detection, if any
+static bool ddc_detected;               // whether registry was built at least once
+static bool ddc_redetect;               // whether displays changed while detecting
+static ddc_deferred_set deferred_set;
+static struct _get_request **waiting_gets;  // GetAll requests waiting for first detection
+static int num_waiting_gets;
+static struct _smooth_client **orphans;     // removed clients waiting for their in-flight op
+static int num_orphans;
+
+static void start_ddc_detection(void);
+static void detect_ddc_displays(void *data);
+static void on_ddc_detected(void *data);
+static void free_ddc_detection(ddc_detection *det);
+static void defer_ddc_setall(double target_pct, int is_smooth, double smooth_step, 
+                             unsigned int smooth_wait, int verse);
+static void refresh_ddcci_coverage(void);
+static void init_ddc(void);
+static void receive_ddc(const int fd);
+static void destroy_ddc(void);
+static void load_sleep_mults(void);
+static void store_sleep_mults(void);
+static bool tune_sleep_mult(const ddc_op *op);
+static int submit_ddc_op(ddc_op_type type, const char *id, const uint16_t val, void (*cb)(ddc_op *op), void *ctx);
+static void ddc_op_work(void *data);
+static void on_ddc_op_done(void *data);
+static void on_ddc_op_cancel(void *data);
+static void on_ddc_step_done(ddc_op *op);
+static void on_ddc_get_done(ddc_op *op);
+
+/* 
+ * Iterate registered displays without touching the hardware.
+ * Displays driven by ddcci kernel driver are skipped: they are managed through sysfs.
+ */
+#define DDCUTIL_FOREACH(func) \
+    for (int ndx = 0; ndx < num_ddc_displays; ndx++) { \
+        if (strlen(ddc_displays[ndx].ddcci)) { \
+            continue; \
         } \
-        ddca_free_display_info_list(dlist); \
-    }
-
-#define DDCUTIL_FUNC(sn, func) \
-    const DDCA_Vcp_Feature_Code br_code = 0x10; \
-    DDCA_Display_Identifier pdid = NULL; \
-    DDCA_Display_Ref dref = NULL; \
-    DDCA_Display_Handle dh = NULL; \
-    DDCA_Any_Vcp_Value *valrec = NULL; \
-    if (convert_sn_to_id(sn, &pdid)) { \
-        goto end; \
-    } \
-    if (ddca_get_display_ref(pdid, &dref)) { \
-        goto end; \
-    } \
-    if (ddca_open_display2(dref, false, &dh)) { \
-        goto end; \
-    } \
-    if (!ddca_get_any_vcp_value_using_explicit_type(dh, br_code, DDCA_NON_TABLE_VCP_VALUE, &valrec)) { \
+        const char *id = ddc_displays[ndx].id; \
         func; \
-        ddca_free_any_vcp_value(valrec); \
-    } \
-end: \
-    if (dh) { \
-        ddca_close_display(dh); \
-    } \
-    if (pdid) { \
-        ddca_free_display_identifier(pdid); \
     }
 
     static void get_info_id(char *id, const int size, const DDCA_Display_Info *dinfo) {
@@ -92,49 +184,262 @@ end: \
         /* Ok it is a normal sn */
         return ddca_create_mfg_model_sn_display_identifier(NULL, NULL, sn, pdid);
     }
-
+    
+    static ddc_display *get_ddc_display(const char *sn) {
+        for (int i = 0; i < num_ddc_displays; i++) {
+            if (!strcmp(ddc_displays[i].id, sn)) {
+                return &ddc_displays[i];
+            }
+        }
+        return NULL;
+    }
+    
+    /* Prefer ddcci kernel driver sysfs interface for displays it drives */
+    static const char *get_ddcci_sn(const char *sn) {
+        ddc_display *d = get_ddc_display(sn);
+        if (d && strlen(d->ddcci)) {
+            return d->ddcci;
+        }
+        return sn;
+    }
+    
+    /* Resolve a display ref from its sn; called by ddc workers for displays not found in registry */
+    static DDCA_Status resolve_display_ref(const char *sn, DDCA_Display_Ref *dref) {
+        DDCA_Display_Identifier pdid = NULL;
+        DDCA_Status rc = convert_sn_to_id(sn, &pdid);
+        if (!rc) {
+            rc = ddca_get_display_ref(pdid, dref);
+            ddca_free_display_identifier(pdid);
+        }
+        return rc;
+    }
+    
 #else
 
-#define DDCUTIL_LOOP(func) do {} while(0)
-#define DDCUTIL_FUNC(sn, func) do {} while(0)
+#define DDCUTIL_FOREACH(func) do {} while(0)
+#define get_ddcci_sn(sn) sn
+#define refresh_ddcci_coverage() do {} while(0)
+#define defer_ddc_setall(target_pct, is_smooth, smooth_step, smooth_wait, verse) do {} while(0)
+#define init_ddc() do {} while(0)
+#define receive_ddc(fd) do {} while(0)
+#define destroy_ddc() do {} while(0)
 
 #endif
 
 typedef struct {
     char *sn;
     bool reached_target;
+    bool external;              // whether sn was not found as an internal backlight interface
 } device;
 
-typedef struct {
+typedef struct _transition_group transition_group;
+
+typedef struct _smooth_client {
     double target_pct;
     double smooth_step;
     unsigned int smooth_wait;
-    int smooth_fd;
+    unsigned int duration;      // duration mode: total transition duration, in ms
+    uint64_t start_ts;          // transition start time, in ms
+    double start_pct;           // backlight pct when transition started; < 0 if not started yet
+    double end_pct;             // absolute target pct, computed on first step
+    double pct;                 // last computed (unquantized) backlight pct
+    deadline_t timer;           // unused while client belongs to a group
+    transition_group *group;
     device d;
     double verse;
+    int br_fd;                  // internal backlight "brightness" sysattr fd, kept open for the whole transition
+    int br_max;                 // internal backlight cached max_brightness
+#ifdef DDC_PRESENT
+    bool held;                  // whether external display handle is held open for the whole transition
+    bool in_flight;             // whether a ddc op is queued for this client
+    bool orphan;                // client was removed while a ddc op was in flight
+#endif
 } smooth_client;
 
+/* 
+ * Transitions started by the same SetAll request:
+ * they are stepped together, on a single shared timer, so each step is a single wakeup.
+ */
+struct _transition_group {
+    deadline_t timer;
+    smooth_client **members;
+    int num_members;
+    bool stepping;              // whether members are being stepped right now
+};
+
+/* 
+ * Shadow of last known raw brightness value of a device, shared by all its transitions.
+ * It is used to serve getters too: internal backlights are kept up to date by udev events, 
+ * while external ones expire after conf.ddc_cache_ttl ms as their changes cannot be observed.
+ */
+typedef struct {
+    char *id;
+    char *path;                 // device object path
+    int curr;                   // < 0 if unknown
+    int max;
+    uint64_t ts;                // when curr was last read or written, in ms
+    bool external;
+    double latency;             // moving average of ddc writes duration, in ms; 0 if unknown
+} backlight_dev;
+
+typedef struct _get_request {
+    sd_bus_message *m;          // method call being replied
+    sd_bus_message *reply;
+    bool array;                 // whether reply is an array of backlights
+    int pending;                // number of ddc reads still in flight (or ddc detection, if waiting for it)
+    int found;                  // number of backlights appended to reply
+} get_request;
+
+typedef struct {
+    char **nodes;
+    int num;
+} node_list;
+
+/* A SetMany entry */
+typedef struct {
+    const char *sn;
+    double target_pct;
+    int is_smooth;
+    double smooth_step;
+    unsigned int smooth_wait;
+    bool valid;
+} set_request;
+
+/* An ambient brightness curve point */
+typedef struct {
+    double ambient;
+    double backlight;
+} curve_point;
+
+/* 
+ * In-daemon ambient brightness control loop: sensor captures are mapped through curve
+ * and applied to every backlight, without any bus round trip.
+ * Only the client that started it can stop it; it is stopped too when its owner leaves the bus.
+ */
+typedef struct {
+    char *owner;                // unique bus name of client that started the loop
+    sd_bus_slot *slot;          // NameOwnerChanged match for owner
+    char *sensor;               // sensor name, or empty for first available one
+    char *interface;
+    char *settings;
+    int num_captures;
+    unsigned int interval;      // ms between captures
+    curve_point *curve;         // sorted by ambient pct
+    int num_points;
+    int is_smooth;
+    double smooth_step;
+    unsigned int smooth_wait;
+    double last_pct;            // last applied backlight pct; < 0 if none
+    bool capturing;             // whether a capture is in flight
+    bool orphan;                // loop was stopped while capturing: free it once capture is done
+    deadline_t timer;
+} ambient_loop;
+
+/* A sysfs backlight: either an internal panel or an external monitor driven by ddcci kernel driver */
+typedef struct {
+    char sysname[32];
+    int busno;                  // ddcci: i2c bus number of the monitor; -1 for internal panels
+    char parent[256];           // internal panels: syspath of the device driving them
+    int type;                   // internal panels: rank of their "type" attribute, lower is preferred
+    bool shadowed;              // a preferred backlight drives the same panel: it is not set by SetAll
+} sysfs_backlight;
+
+/* Iterate all sysfs backlights */
+#define SYSFS_FOREACH(func) \
+    for (int ndx = 0; ndx < num_sysfs_devs; ndx++) { \
+        const char *id = sysfs_devs[ndx].sysname; \
+        func; \
+    }
+
+/* Iterate ddcci kernel driver backlights */
+#define DDCCI_FOREACH(func) \
+    SYSFS_FOREACH({ \
+        if (sysfs_devs[ndx].busno >= 0) { \
+            func; \
+        } \
+    })
+
+static void start(void);
 static void dtor_client(void *client);
+static void on_smooth_step(deadline_t *d);
+static int step_client(smooth_client *sc);
+static void end_smooth_step(smooth_client *sc, const int ret);
+static unsigned int next_step_wait(const smooth_client *sc);
+static transition_group *new_group(void);
+static void join_group(transition_group *g, smooth_client *sc);
+static void leave_group(smooth_client *sc);
+static void start_group(transition_group *g);
+static void free_group(transition_group *g);
+static void on_group_step(deadline_t *d);
 static int method_setallbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static void set_all_backlights(double target_pct, int is_smooth, double smooth_step, 
+                               unsigned int smooth_wait, int verse, const char *backlight_interface);
+static int method_startambient(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int method_stopambient(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int on_ambient_owner_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static void on_ambient_tick(deadline_t *d);
+static void on_ambient_capture(const int r, const char *devnode, const double *pct, const int num_captures, void *userdata);
+static double map_ambient(const ambient_loop *a, const double ambient_pct);
+static void stop_ambient(void);
+static void free_ambient(ambient_loop *a);
 static int method_getallbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 static int method_raiseallbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 static int method_lowerallbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 static int method_setbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int method_setmanybrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 static int method_getbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 static int method_raisebrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 static int method_lowerbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 static void reset_backlight_struct(smooth_client *sc, double target_pct, int is_smooth, double smooth_step, 
                                              unsigned int smooth_wait, int verse);
-static int add_backlight_sn(double target_pct, int is_smooth, double smooth_step, 
-                            unsigned int smooth_wait, int verse, const char *sn, bool internal);
+static smooth_client *add_backlight_sn(double target_pct, int is_smooth, double smooth_step, 
+                                       unsigned int smooth_wait, int verse, const char *sn, bool internal);
+static void set_backlight_sn(double target_pct, int is_smooth, double smooth_step, 
+                             unsigned int smooth_wait, int verse, const char *sn);
+static smooth_client *start_backlight_sn(double target_pct, int is_smooth, double smooth_step, 
+                                         unsigned int smooth_wait, int verse, const char *sn, bool internal);
+static bool retarget_client(smooth_client *sc, double target_pct, int verse);
+static void sanitize_transition(double *target_pct, double *smooth_step);
 static double next_backlight_level(smooth_client *sc, int curr, int max);
+static backlight_dev *get_backlight_dev(const char *id);
+static void dtor_backlight_dev(void *data);
+static void scan_internal_devs(const bool export);
+static void add_internal_dev(struct udev_device *dev);
+static int get_ddcci_busno(struct udev_device *dev);
+static void get_panel_parent(struct udev_device *dev, sysfs_backlight *b);
+static void mark_shadowed_devs(void);
+static bool is_exported(const backlight_dev *dev);
+static int find_backlight_dev(sd_bus *b, const char *path, const char *interface, void *userdata, 
+                              void **found, sd_bus_error *ret_error);
+static int enumerate_backlight_devs(sd_bus *b, const char *prefix, void *userdata, 
+                                    char ***nodes, sd_bus_error *ret_error);
+static int get_dev_brightness(sd_bus *b, const char *path, const char *interface, const char *property,
+                              sd_bus_message *reply, void *userdata, sd_bus_error *error);
+static void update_backlight_dev(backlight_dev *dev, const int curr, const int max);
+static void update_write_latency(backlight_dev *dev, const unsigned int write_ms);
+static double get_step_scale(const smooth_client *sc);
+static int get_dev_latency(sd_bus *b, const char *path, const char *interface, const char *property,
+                           sd_bus_message *reply, void *userdata, sd_bus_error *error);
+static bool is_cached(const backlight_dev *dev);
+static void receive_backlight_change(void);
+static uint64_t now_ms(void);
+static int open_internal_backlight(smooth_client *sc);
 static int set_internal_backlight(smooth_client *sc);
 static int set_external_backlight(smooth_client *sc);
 static void append_backlight(sd_bus_message *reply, const char *name, const double pct);
 static int append_internal_backlight(sd_bus_message *reply, const char *path);
-static int append_external_backlight(sd_bus_message *reply, const char *sn);
+static void append_external_backlight(get_request *req, const char *sn);
+static void complete_get_request(get_request *req);
 
 static map_t *running_clients;
+static map_t *devices;                        // device id -> backlight_dev
+static int bl_mon_handler = -1, bl_mon_fd = -1;
+static char default_bl[64];                   // cached sysname of first internal backlight
+static sysfs_backlight *sysfs_devs;
+static int num_sysfs_devs;
+static ambient_loop *ambient;
+static bool started;                          // whether start() was called, ie: any method was called
+static const unsigned int duration_tick = 30; // ms between steps in duration mode
 static const char object_path[] = "/org/clightd/clightd/Backlight";
 static const char bus_interface[] = "org.clightd.clightd.Backlight";
 static const sd_bus_vtable vtable[] = {
@@ -144,9 +449,21 @@ static const sd_bus_vtable vtable[] = {
     SD_BUS_METHOD("RaiseAll", "d(bdu)s", "b", method_raiseallbrightness, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("LowerAll", "d(bdu)s", "b", method_lowerallbrightness, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("Set", "d(bdu)s", "b", method_setbrightness, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("SetMany", "a(sd(bdu))", "ab", method_setmanybrightness, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("Get", "s", "(sd)", method_getbrightness, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("Raise", "d(bdu)s", "b", method_raisebrightness, SD_BUS_VTABLE_UNPRIVILEGED),
     SD_BUS_METHOD("Lower", "d(bdu)s", "b", method_lowerbrightness, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("StartAmbient", "sssiua(dd)(bdu)", "b", method_startambient, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("StopAmbient", NULL, "b", method_stopambient, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_SIGNAL("AmbientApplied", "dd", 0),
+    SD_BUS_VTABLE_END
+};
+/* Each backlight device is exported as object_path/$encoded_id */
+static const char dev_interface[] = "org.clightd.clightd.Backlight.Device";
+static const sd_bus_vtable dev_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_PROPERTY("Brightness", "d", get_dev_brightness, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+    SD_BUS_PROPERTY("WriteLatency", "u", get_dev_latency, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
     SD_BUS_VTABLE_END
 };
 
@@ -166,93 +483,282 @@ static bool evaluate(void) {
 
 static void init(void) {
     running_clients = map_new(false, dtor_client);
-    int r = sd_bus_add_object_vtable(bus,
-                                 NULL,
-                                 object_path,
-                                 bus_interface,
-                                 vtable,
-                                 NULL);
+    devices = map_new(true, dtor_backlight_dev);
+    int r = stats_add_object_vtable(bus,
+                                NULL,
+                                object_path,
+                                bus_interface,
+                                vtable,
+                                NULL);
+    if (r >= 0) {
+        r = sd_bus_add_fallback_vtable(bus,
+                                       NULL,
+                                       object_path,
+                                       dev_interface,
+                                       dev_vtable,
+                                       find_backlight_dev,
+                                       NULL);
+    }
+    if (r >= 0) {
+        r = sd_bus_add_node_enumerator(bus, NULL, object_path, enumerate_backlight_devs, NULL);
+    }
+    if (r >= 0) {
+        r = lazy_register(object_path, start);
+    }
     if (r < 0) {
         m_log("Failed to issue method call: %s\n", strerror(-r));
     }
 }
 
-static void receive(const msg_t *msg, const void *userdata) {
-    uint64_t t;
+/* Called on first method call on Backlight objects */
+static void start(void) {
+    m_log("Starting.\n");
+    started = true;
+    /* Internal backlight changes not issued by us invalidate devices shadows */
+    bl_mon_fd = init_udev_monitor("backlight", &bl_mon_handler);
+    m_register_fd(bl_mon_fd, false, NULL);
+    scan_internal_devs(true);
+    init_ddc();
+}
 
+static void receive(const msg_t *msg, const void *userdata) {
     if (!msg->is_pubsub) {
-        smooth_client *sc = (smooth_client *)msg->fd_msg->userptr;
-        read(sc->smooth_fd, &t, sizeof(uint64_t));
-        if (!sc->d.reached_target) {
-            int ret = set_internal_backlight(sc);
-            // error: it was not an internal backlight interface
-            if (ret == -1) {
-                // try to use it as external backlight sn
-                set_external_backlight(sc);
-            }
-        }
-
-        if (!sc->d.reached_target) {
-            struct itimerspec timerValue = {{0}};
-            timerValue.it_value.tv_sec = sc->smooth_wait / 1000;
-            timerValue.it_value.tv_nsec = 1000 * 1000 * (sc->smooth_wait % 1000); // ms
-            timerfd_settime(sc->smooth_fd, 0, &timerValue, NULL);
+        if (msg->fd_msg->fd == bl_mon_fd) {
+            receive_backlight_change();
         } else {
-            m_log("%s reached target backlight: %s%.2lf.\n", sc->d.sn, sc->verse > 0 ? "+" : (sc->verse < 0 ? "-" : ""), sc->target_pct);
-            map_remove(running_clients, sc->d.sn);
+            /* Other registered fds are ddc workers eventfd and udev monitors for ddc displays hotplug */
+            receive_ddc(msg->fd_msg->fd);
         }
     }
 }
 
 static void destroy(void) {
+    /* If no method was ever called, only exported objects were set up */
+    if (started) {
+        stop_ambient();
+        /* Join ddc workers first: no op is in flight anymore once clients are freed */
+        destroy_ddc();
+    }
     map_free(running_clients);
+    map_free(devices);
+    free(sysfs_devs);
 }
 
 static void dtor_client(void *client) {
     smooth_client *sc = (smooth_client *)client;
     /* Free all resources */
-    m_deregister_fd(sc->smooth_fd); // this will automatically close it!
+    leave_group(sc);
+    deadline_cancel(&sc->timer);
+    if (sc->br_fd >= 0) {
+        close(sc->br_fd);
+        sc->br_fd = -1;
+    }
+#ifdef DDC_PRESENT
+    if (sc->in_flight && ddc_pool) {
+        /* It will be destroyed by on_ddc_step_done() once its op completes */
+        smooth_client **tmp = realloc(orphans, sizeof(smooth_client *) * (num_orphans + 1));
+        if (tmp) {
+            orphans = tmp;
+            orphans[num_orphans++] = sc;
+        }
+        sc->orphan = true;
+        return;
+    }
+    if (sc->held) {
+        submit_ddc_op(DDC_RELEASE, sc->d.sn, 0, NULL, NULL);
+    }
+#endif
     free(sc->d.sn);
     free(sc);
 }
 
+static void on_smooth_step(deadline_t *d) {
+    smooth_client *sc = (smooth_client *)d->userdata;
+    int ret = step_client(sc);
+    /* A ddc op was queued: step will be ended by on_ddc_step_done() */
+    if (ret <= 0) {
+        end_smooth_step(sc, ret);
+    }
+}
+
+static int step_client(smooth_client *sc) {
+    int ret = 0;
+    if (!sc->d.reached_target) {
+        ret = set_internal_backlight(sc);
+        // error: it was not an internal backlight interface
+        if (ret == -ENODEV) {
+            // try to use it as external backlight sn
+            ret = set_external_backlight(sc);
+        }
+        USDT(backlight__step, sc->d.sn, (int)(sc->target_pct * 1000), (int)sc->verse, ret);
+    }
+    return ret;
+}
+
+static void end_smooth_step(smooth_client *sc, const int ret) {
+    if (ret < 0) {
+        m_log("Failed to set %s backlight.\n", sc->d.sn);
+        sc->d.reached_target = true;
+    }
+    
+    if (!sc->d.reached_target) {
+        /* Grouped clients are scheduled by their group */
+        if (!sc->group) {
+            deadline_set(&sc->timer, next_step_wait(sc));
+        }
+    } else {
+        m_log("%s reached target backlight: %s%.2lf.\n", sc->d.sn, sc->verse > 0 ? "+" : (sc->verse < 0 ? "-" : ""), sc->target_pct);
+        map_remove(running_clients, sc->d.sn);
+    }
+}
+
+static unsigned int next_step_wait(const smooth_client *sc) {
+    unsigned int wait = sc->smooth_wait;
+    if (sc->duration > 0) {
+        /* Do not overshoot transition end */
+        const uint64_t elapsed = now_ms() - sc->start_ts;
+        if (elapsed + wait > sc->duration) {
+            wait = elapsed < sc->duration ? sc->duration - elapsed : 0;
+        }
+    }
+    return wait;
+}
+
+static transition_group *new_group(void) {
+    transition_group *g = calloc(1, sizeof(transition_group));
+    if (g) {
+        deadline_init(&g->timer, on_group_step, g);
+    }
+    return g;
+}
+
+/* sc is now stepped by g: its own timer is stopped */
+static void join_group(transition_group *g, smooth_client *sc) {
+    if (!g || !sc) {
+        return;
+    }
+    smooth_client **tmp = realloc(g->members, sizeof(smooth_client *) * (g->num_members + 1));
+    if (tmp) {
+        g->members = tmp;
+        g->members[g->num_members++] = sc;
+        deadline_cancel(&sc->timer);
+        sc->group = g;
+    }
+}
+
+static void leave_group(smooth_client *sc) {
+    transition_group *g = sc->group;
+    if (!g) {
+        return;
+    }
+    for (int i = 0; i < g->num_members; i++) {
+        if (g->members[i] == sc) {
+            g->members[i] = g->members[--g->num_members];
+            break;
+        }
+    }
+    sc->group = NULL;
+    /* When stepping, on_group_step() takes care of freeing it */
+    if (g->num_members == 0 && !g->stepping) {
+        free_group(g);
+    }
+}
+
+static void start_group(transition_group *g) {
+    if (g) {
+        if (g->num_members > 0) {
+            deadline_set(&g->timer, 0); // immediately
+        } else {
+            free_group(g);
+        }
+    }
+}
+
+static void free_group(transition_group *g) {
+    deadline_cancel(&g->timer);
+    free(g->members);
+    free(g);
+}
+
+static void on_group_step(deadline_t *d) {
+    transition_group *g = (transition_group *)d->userdata;
+    
+    /* 
+     * Iterate backward: a member that ended its transition leaves the group
+     * by swapping the last member, already stepped, in its place.
+     */
+    g->stepping = true;
+    for (int i = g->num_members - 1; i >= 0; i--) {
+        smooth_client *sc = g->members[i];
+        int ret = step_client(sc);
+        /* A ddc op was queued: step will be ended by on_ddc_step_done() */
+        if (ret <= 0) {
+            end_smooth_step(sc, ret);
+        }
+    }
+    g->stepping = false;
+    
+    if (g->num_members == 0) {
+        free_group(g);
+    } else {
+        unsigned int wait = next_step_wait(g->members[0]);
+        for (int i = 1; i < g->num_members; i++) {
+            const unsigned int w = next_step_wait(g->members[i]);
+            if (w < wait) {
+                wait = w;
+            }
+        }
+        deadline_set(&g->timer, wait);
+    }
+}
+
 static void reset_backlight_struct(smooth_client *sc, double target_pct, int is_smooth, double smooth_step, 
                                              unsigned int smooth_wait, int verse) {
     sc->smooth_step = is_smooth ? smooth_step : 0.0;
     sc->smooth_wait = is_smooth ? smooth_wait : 0;
+    /* 
+     * Smooth transitions with a 0 step are driven by total duration (smooth_wait ms):
+     * each step computes backlight level from elapsed time, thus late steps are skipped.
+     */
+    sc->duration = 0;
+    if (is_smooth && smooth_step == 0.0 && smooth_wait > 0) {
+        sc->duration = smooth_wait;
+        sc->smooth_wait = duration_tick;
+    }
+    sc->start_pct = -1.0;
     sc->target_pct = target_pct;
     sc->verse = verse;
+    sc->d.reached_target = false;
     
-    /* Only if not already there */
-    if (sc->smooth_fd == 0) {
-        sc->smooth_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
-        m_register_fd(sc->smooth_fd, true, sc);
-    }
-    
-    struct itimerspec timerValue = {{0}};
-    timerValue.it_value.tv_sec = 0;
-    timerValue.it_value.tv_nsec = 1; // immediately
-    timerfd_settime(sc->smooth_fd, 0, &timerValue, NULL);
+    /* A new request for this client only: step it on its own */
+    leave_group(sc);
+    deadline_set(&sc->timer, 0); // immediately
 }
 
-static int add_backlight_sn(double target_pct, int is_smooth, double smooth_step, 
-                             unsigned int smooth_wait, int verse, const char *sn, bool internal) {
+static smooth_client *add_backlight_sn(double target_pct, int is_smooth, double smooth_step, 
+                                       unsigned int smooth_wait, int verse, const char *sn, bool internal) {
     bool ok = !internal;
+    smooth_client *sc = NULL;
     struct udev_device *dev = NULL;
     
     /* Properly check internal interface exists before adding it */
     if (internal) {
-        get_udev_device(sn, "backlight", NULL, NULL, &dev);
+        if (!sn || !strlen(sn)) {
+            sn = default_bl;
+        }
+        if (strlen(sn)) {
+            get_udev_device(sn, "backlight", NULL, NULL, &dev);
+        }
         if (dev) {
             ok = true;
-            if (!sn || !strlen(sn)) {
-                sn = udev_device_get_sysname(dev);
-            }
+            sn = udev_device_get_sysname(dev);
         }
     }
 
     if (ok) {
-        smooth_client *sc = calloc(1, sizeof(smooth_client));
+        sc = calloc(1, sizeof(smooth_client));
+        sc->br_fd = -1;
+        deadline_init(&sc->timer, on_smooth_step, sc);
         reset_backlight_struct(sc, target_pct, is_smooth, smooth_step, smooth_wait, verse);
         sc->d.sn = strdup(sn);
         sc->d.reached_target = false;
@@ -263,14 +769,11 @@ static int add_backlight_sn(double target_pct, int is_smooth, double smooth_step
     if (dev) {
         udev_device_unref(dev);
     }
-    return ok;
+    return sc;
 }
 
 static int method_setallbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-    if (!check_authorization(m)) {
-        sd_bus_error_set_errno(ret_error, EPERM);
-        return -EPERM;
-    }
+    ASSERT_AUTH(m, method_setallbrightness, userdata, ret_error);
 
     const char *backlight_interface = NULL;
     double target_pct, smooth_step;
@@ -280,194 +783,834 @@ static int method_setallbrightness(sd_bus_message *m, void *userdata, sd_bus_err
     int r = sd_bus_message_read(m, "d(bdu)s", &target_pct, &is_smooth, &smooth_step,
                                 &smooth_wait, &backlight_interface);
     if (r >= 0) {
-        /** Sanity checks **/
-        if (target_pct > 1.0) {
-            target_pct = 1.0;
-        } else if (target_pct < 0.0) {
-            target_pct = 0.0;
-        }
-
-        if (smooth_step > 1.0) {
-            smooth_step = 1.0;
-        } else if (smooth_step <= 0.0) {
-            smooth_step = 0.0; // disable smoothing
-        }
-        /** End of sanity checks **/
-
         int verse = 0;
         if (userdata) {
             verse = *((int *)userdata);
         }
-
-        /* Clear map */
-        map_clear(running_clients);
-        add_backlight_sn(target_pct, is_smooth, smooth_step, smooth_wait, verse, backlight_interface, true);
-        DDCUTIL_LOOP({
-            add_backlight_sn(target_pct, is_smooth, smooth_step, smooth_wait, verse, id, false);
-        });
-        m_log("Target pct (smooth %d): %s%.2lf\n", is_smooth, verse > 0 ? "+" : (verse < 0 ? "-" : ""), target_pct);
+        set_all_backlights(target_pct, is_smooth, smooth_step, smooth_wait, verse, backlight_interface);
         // Returns true if no errors happened; false if another client is already changing backlight
         r = sd_bus_reply_method_return(m, "b", true);
     }
     return r;
 }
 
-static double next_backlight_level(smooth_client *sc, int curr, int max) {
-    double curr_pct = curr / (double)max;
-    double target_pct = sc->target_pct;
-    if (sc->verse != 0) {
-        target_pct = curr_pct + (sc->verse * sc->target_pct);
-        /* Sanity checks */
-        if (target_pct > 1.0) {
-            target_pct = 1.0;
-        } else if (target_pct < 0.0) {
-            target_pct = 0.0;
-        }
-    } 
-    if (sc->smooth_step > 0) {
-        if (target_pct < curr_pct) {
-            curr_pct = (curr_pct - sc->smooth_step < target_pct) ? 
-            target_pct : curr_pct - sc->smooth_step;
-        } else if (target_pct > curr_pct) {
-            curr_pct = (curr_pct + sc->smooth_step) > target_pct ? 
-            target_pct : curr_pct + sc->smooth_step;
+static void set_all_backlights(double target_pct, int is_smooth, double smooth_step, 
+                               unsigned int smooth_wait, int verse, const char *backlight_interface) {
+    sanitize_transition(&target_pct, &smooth_step);
+
+    /* Relative requests retarget running transitions: only absolute ones restart them all */
+    if (verse == 0) {
+        map_clear(running_clients);
+    }
+    
+    /* 
+     * Every sysfs backlight (or only required internal one plus ddcci ones) and ddc display is stepped together; 
+     * a panel exposed by many sysfs backlights is only driven through its preferred one.
+     */
+    transition_group *g = new_group();
+    if (backlight_interface && strlen(backlight_interface)) {
+        join_group(g, start_backlight_sn(target_pct, is_smooth, smooth_step, smooth_wait, verse, backlight_interface, true));
+        DDCCI_FOREACH({
+            if (strcmp(id, backlight_interface)) {
+                join_group(g, start_backlight_sn(target_pct, is_smooth, smooth_step, smooth_wait, verse, id, true));
+            }
+        });
+    } else {
+        SYSFS_FOREACH({
+            if (!sysfs_devs[ndx].shadowed) {
+                join_group(g, start_backlight_sn(target_pct, is_smooth, smooth_step, smooth_wait, verse, id, true));
+            }
+        });
+    }
+    DDCUTIL_FOREACH({
+        join_group(g, start_backlight_sn(target_pct, is_smooth, smooth_step, smooth_wait, verse, id, false));
+    });
+    start_group(g);
+    defer_ddc_setall(target_pct, is_smooth, smooth_step, smooth_wait, verse);
+    m_log("Target pct (smooth %d): %s%.2lf\n", is_smooth, verse > 0 ? "+" : (verse < 0 ? "-" : ""), target_pct);
+}
+
+/*
+ * Start (or reconfigure, if called by its owner) ambient brightness control loop.
+ * Every interval ms, num_captures are captured from sensor; their average is mapped 
+ * through curve points (ambient pct -> backlight pct, linearly interpolated) 
+ * and applied to every backlight with requested transition. 
+ * AmbientApplied signal is emitted for each applied value.
+ */
+static int method_startambient(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    ASSERT_AUTH(m, method_startambient, userdata, ret_error);
+    
+    const char *sender = sd_bus_message_get_sender(m);
+    if (ambient && strcmp(ambient->owner, sender)) {
+        sd_bus_error_set_const(ret_error, SD_BUS_ERROR_FAILED, "Ambient loop is owned by another client.");
+        return -EBUSY;
+    }
+    
+    const char *sensor = NULL, *interface = NULL, *settings = NULL;
+    int num_captures;
+    unsigned int interval;
+    int r = sd_bus_message_read(m, "sssiu", &sensor, &interface, &settings, &num_captures, &interval);
+    if (r < 0) {
+        m_log("Failed to parse parameters: %s\n", strerror(-r));
+        return r;
+    }
+    
+    if (num_captures <= 0 || num_captures > 20 || interval == 0) {
+        sd_bus_error_set_const(ret_error, SD_BUS_ERROR_FAILED, 
+                               "Number of captures should be between 1 and 20, and interval greater than 0.");
+        return -EINVAL;
+    }
+    
+    ambient_loop *a = calloc(1, sizeof(ambient_loop));
+    if (!a) {
+        sd_bus_error_set_errno(ret_error, ENOMEM);
+        return -ENOMEM;
+    }
+    
+    r = sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "(dd)");
+    if (r >= 0) {
+        curve_point p;
+        while ((r = sd_bus_message_read(m, "(dd)", &p.ambient, &p.backlight)) > 0) {
+            /* Points must be sorted by ambient pct, and both pcts must be in [0, 1] */
+            if (p.ambient < 0.0 || p.ambient > 1.0 || p.backlight < 0.0 || p.backlight > 1.0 ||
+                (a->num_points > 0 && p.ambient <= a->curve[a->num_points - 1].ambient)) {
+                
+                r = -EINVAL;
+                break;
+            }
+            curve_point *tmp = realloc(a->curve, sizeof(curve_point) * (a->num_points + 1));
+            if (!tmp) {
+                r = -ENOMEM;
+                break;
+            }
+            a->curve = tmp;
+            a->curve[a->num_points++] = p;
+        }
+        if (r >= 0) {
+            r = sd_bus_message_exit_container(m);
+        }
+    }
+    if (r >= 0) {
+        r = sd_bus_message_read(m, "(bdu)", &a->is_smooth, &a->smooth_step, &a->smooth_wait);
+    }
+    if (r >= 0 && a->num_points == 0) {
+        r = -EINVAL;
+    }
+    
+    if (r >= 0) {
+        a->owner = strdup(sender);
+        a->sensor = strdup(sensor);
+        a->interface = strdup(interface);
+        a->settings = strdup(settings);
+        a->num_captures = num_captures;
+        a->interval = interval;
+        a->last_pct = -1.0;
+        deadline_init(&a->timer, on_ambient_tick, a);
+        
+        char match[256];
+        snprintf(match, sizeof(match), 
+                 "type='signal',sender='org.freedesktop.DBus',interface='org.freedesktop.DBus',"
+                 "member='NameOwnerChanged',arg0='%s'", sender);
+        r = sd_bus_add_match(bus, &a->slot, match, on_ambient_owner_changed, NULL);
+    }
+    
+    if (r < 0) {
+        if (r == -EINVAL) {
+            sd_bus_error_set_const(ret_error, SD_BUS_ERROR_INVALID_ARGS, 
+                                   "Curve points should be sorted by ambient pct, with both pcts between 0 and 1.");
         } else {
-            curr_pct = -1.0f; // useless
+            sd_bus_error_set_errno(ret_error, -r);
         }
-    } else {
-        curr_pct = target_pct;
+        sd_bus_slot_unref(a->slot);
+        free(a->owner);
+        free(a->sensor);
+        free(a->interface);
+        free(a->settings);
+        free(a->curve);
+        free(a);
+        return r;
     }
+    
+    /* Replace any loop previously started by same owner */
+    stop_ambient();
+    ambient = a;
+    deadline_set(&a->timer, 0); // immediately
+    m_log("Ambient loop started by %s, every %u ms.\n", a->owner, a->interval);
+    return sd_bus_reply_method_return(m, "b", true);
+}
 
-    if (curr_pct == target_pct || curr_pct == -1.0f) {
-        sc->d.reached_target = true;
+static int method_stopambient(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    if (!ambient || strcmp(ambient->owner, sd_bus_message_get_sender(m))) {
+        sd_bus_error_set_errno(ret_error, EPERM);
+        return -EPERM;
     }
+    stop_ambient();
+    return sd_bus_reply_method_return(m, "b", true);
+}
 
-    return curr_pct;
+static int on_ambient_owner_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    const char *name = NULL, *old_owner = NULL, *new_owner = NULL;
+    int r = sd_bus_message_read(m, "sss", &name, &old_owner, &new_owner);
+    if (r >= 0 && ambient && !strcmp(name, ambient->owner) && !strlen(new_owner)) {
+        m_log("Ambient loop owner %s left the bus.\n", name);
+        stop_ambient();
+    }
+    return 0;
 }
 
-static int set_internal_backlight(smooth_client *sc) {
-    int r = -1;
+static void on_ambient_tick(deadline_t *d) {
+    ambient_loop *a = (ambient_loop *)d->userdata;
+    
+    /* Loop goes on from on_ambient_capture() */
+    int r = sensor_capture_async(a->sensor, a->interface, a->num_captures, a->settings, on_ambient_capture, a);
+    if (r == 0) {
+        a->capturing = true;
+    } else {
+        m_log("Ambient capture failed: %s\n", strerror(-r));
+        deadline_set(&a->timer, a->interval);
+    }
+}
 
-    struct udev_device *dev = NULL;
-    get_udev_device(sc->d.sn, "backlight", NULL, NULL, &dev);
-    if (dev) {
-        int max = atoi(udev_device_get_sysattr_value(dev, "max_brightness"));
-        int curr = atoi(udev_device_get_sysattr_value(dev, "brightness"));
-        int value = next_backlight_level(sc, curr, max) * max;
-        /* Check if next_backlight_level returned -1 */
-        if (value >= 0) {
-            char val[15] = {0};
-            snprintf(val, sizeof(val) - 1, "%d", value);
-            r = udev_device_set_sysattr_value(dev, "brightness", val);
+static void on_ambient_capture(const int r, const char *devnode, const double *pct, const int num_captures, void *userdata) {
+    ambient_loop *a = (ambient_loop *)userdata;
+    a->capturing = false;
+    if (a->orphan) {
+        free_ambient(a);
+        return;
+    }
+    if (r == -ECANCELED) {
+        /* Sensor module is being destroyed: stop_ambient() will free it */
+        return;
+    }
+    
+    if (r == 0) {
+        double ambient_pct = 0.0;
+        for (int i = 0; i < num_captures; i++) {
+            ambient_pct += pct[i];
         }
-        udev_device_unref(dev);
+        ambient_pct /= num_captures;
+        
+        const double target_pct = map_ambient(a, ambient_pct);
+        /* Do not restart transitions for the same target */
+        if (fabs(target_pct - a->last_pct) >= 0.001) {
+            set_all_backlights(target_pct, a->is_smooth, a->smooth_step, a->smooth_wait, 0, "");
+            a->last_pct = target_pct;
+            sd_bus_emit_signal(bus, object_path, bus_interface, "AmbientApplied", "dd", ambient_pct, target_pct);
+        }
+    } else {
+        m_log("Ambient capture failed: %s\n", strerror(-r));
     }
-    return r;
+    deadline_set(&a->timer, a->interval);
 }
 
-static int set_external_backlight(smooth_client *sc) {
-    int ret = -1;
-
-    DDCUTIL_FUNC(sc->d.sn, {
-        const uint16_t max = VALREC_MAX_VAL(valrec);
-        const uint16_t curr = VALREC_CUR_VAL(valrec);
-        int16_t new_value = next_backlight_level(sc, curr, max) * max;
-        int8_t new_sh = new_value >> 8;
-        int8_t new_sl = new_value & 0xff;
-        if (new_value >= 0 && ddca_set_non_table_vcp_value(dh, br_code, new_sh, new_sl) == 0) {
-            ret = 0;
+static double map_ambient(const ambient_loop *a, const double ambient_pct) {
+    const curve_point *c = a->curve;
+    if (ambient_pct <= c[0].ambient) {
+        return c[0].backlight;
+    }
+    for (int i = 1; i < a->num_points; i++) {
+        if (ambient_pct <= c[i].ambient) {
+            const double t = (ambient_pct - c[i - 1].ambient) / (c[i].ambient - c[i - 1].ambient);
+            return c[i - 1].backlight + t * (c[i].backlight - c[i - 1].backlight);
         }
-    });
-    return ret;
+    }
+    return c[a->num_points - 1].backlight;
 }
 
-/**
- * Backlight pct getter method: for each screen (both internal and external)
- * it founds, it will return a "(uid, current backlight pct)" struct.
- * Note that for internal laptop screen, uid = syspath (eg: intel_backlight)
- */
-static int method_getallbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-    sd_bus_message *reply = NULL;
-    const char *backlight_interface = NULL;
-
-    int r = sd_bus_message_read(m, "s", &backlight_interface);
-    if (r >= 0) {
-        sd_bus_message_new_method_return(m, &reply);
-        sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "(sd)");
-
-        if (append_internal_backlight(reply, backlight_interface) == -1 &&
-            append_external_backlight(reply, NULL) == -1) {
-            
-            r = -ENODEV;
-            sd_bus_error_set_errno(ret_error, ENODEV);
+static void stop_ambient(void) {
+    if (ambient) {
+        m_log("Ambient loop stopped.\n");
+        deadline_cancel(&ambient->timer);
+        sd_bus_slot_unref(ambient->slot);
+        ambient->slot = NULL;
+        if (ambient->capturing) {
+            /* Its capture callback is still pending */
+            ambient->orphan = true;
         } else {
-            r = 0;
-        }
-
-        sd_bus_message_close_container(reply);
-        if (!r) {
-            r = sd_bus_send(NULL, reply, NULL);
+            free_ambient(ambient);
         }
-        sd_bus_message_unref(reply);
-        sd_bus_message_exit_container(m);
+        ambient = NULL;
     }
-    return r;
 }
 
-static void append_backlight(sd_bus_message *reply, const char *name, const double pct) {
-    sd_bus_message_open_container(reply, SD_BUS_TYPE_STRUCT, "sd");
-    sd_bus_message_append(reply, "sd", name, pct);
-    sd_bus_message_close_container(reply);
+static void free_ambient(ambient_loop *a) {
+    free(a->owner);
+    free(a->sensor);
+    free(a->interface);
+    free(a->settings);
+    free(a->curve);
+    free(a);
 }
 
-static int append_internal_backlight(sd_bus_message *reply, const char *path) {
-    int ret = -1;
-    struct udev_device *dev = NULL;
-    get_udev_device(path, "backlight", NULL, NULL, &dev);
-
-    if (dev) {
+/*
+ * Compute next backlight pct, given current raw value.
+ * Absolute target is computed on first step, so that relative changes are applied only once.
+ * Unquantized pct is kept between steps, so that steps smaller than a raw unit still progress.
+ */
+static double next_backlight_level(smooth_client *sc, int curr, int max) {
+    double curr_pct = curr / (double)max;
+    if (sc->start_pct < 0) {
+        sc->start_pct = curr_pct;
+        sc->start_ts = now_ms();
+        sc->end_pct = sc->target_pct;
+        if (sc->verse != 0) {
+            sc->end_pct = curr_pct + (sc->verse * sc->target_pct);
+            /* Sanity checks */
+            if (sc->end_pct > 1.0) {
+                sc->end_pct = 1.0;
+            } else if (sc->end_pct < 0.0) {
+                sc->end_pct = 0.0;
+            }
+        }
+    } else if ((int)(sc->pct * max) == curr) {
+        /* Backlight was not changed by anyone else since last step */
+        curr_pct = sc->pct;
+    }
+    
+    const double target_pct = sc->end_pct;
+    if (sc->duration > 0) {
+        /* Level only depends on elapsed time: late steps are skipped */
+        const uint64_t elapsed = now_ms() - sc->start_ts;
+        if (elapsed < sc->duration) {
+            curr_pct = sc->start_pct + (target_pct - sc->start_pct) * elapsed / sc->duration;
+        } else {
+            curr_pct = target_pct;
+        }
+    } else if (sc->smooth_step > 0) {
+        const double step = sc->smooth_step * get_step_scale(sc);
+        if (target_pct < curr_pct) {
+            curr_pct = (curr_pct - step < target_pct) ? 
+            target_pct : curr_pct - step;
+        } else if (target_pct > curr_pct) {
+            curr_pct = (curr_pct + step) > target_pct ? 
+            target_pct : curr_pct + step;
+        }
+    } else {
+        curr_pct = target_pct;
+    }
+
+    if (curr_pct == target_pct) {
+        sc->d.reached_target = true;
+    }
+    sc->pct = curr_pct;
+    return curr_pct;
+}
+
+/*
+ * Each step of a ddc display lasts its write latency plus smooth_wait:
+ * enlarge the step accordingly, so that the requested transition time is kept with fewer, larger steps.
+ */
+static double get_step_scale(const smooth_client *sc) {
+    const backlight_dev *dev = sc->d.external ? map_get(devices, sc->d.sn) : NULL;
+    if (!dev || dev->latency <= 0 || sc->smooth_wait == 0) {
+        return 1.0;
+    }
+    return (sc->smooth_wait + dev->latency) / sc->smooth_wait;
+}
+
+static backlight_dev *get_backlight_dev(const char *id) {
+    backlight_dev *dev = map_get(devices, id);
+    if (!dev) {
+        dev = calloc(1, sizeof(backlight_dev));
+        if (dev) {
+            dev->curr = -1;
+            dev->id = strdup(id);
+            sd_bus_path_encode(object_path, id, &dev->path);
+            map_put(devices, id, dev);
+        }
+    }
+    return dev;
+}
+
+static void dtor_backlight_dev(void *data) {
+    backlight_dev *dev = (backlight_dev *)data;
+    free(dev->id);
+    free(dev->path);
+    free(dev);
+}
+
+/* Update device shadow, notifying its Brightness change to bus clients */
+static void update_backlight_dev(backlight_dev *dev, const int curr, const int max) {
+    const bool changed = curr != dev->curr || (max > 0 && max != dev->max);
+    dev->curr = curr;
+    if (max > 0) {
+        dev->max = max;
+    }
+    dev->ts = now_ms();
+    if (changed && curr >= 0 && dev->path && is_exported(dev)) {
+        sd_bus_emit_properties_changed(bus, dev->path, dev_interface, "Brightness", NULL);
+    }
+}
+
+/* Update write latency moving average, notifying its changes to bus clients */
+static void update_write_latency(backlight_dev *dev, const unsigned int write_ms) {
+    const unsigned int old = dev->latency + 0.5;
+    if (dev->latency > 0) {
+        dev->latency = 0.75 * dev->latency + 0.25 * write_ms;
+    } else {
+        dev->latency = write_ms;
+    }
+    if (old != (unsigned int)(dev->latency + 0.5) && dev->path && is_exported(dev)) {
+        sd_bus_emit_properties_changed(bus, dev->path, dev_interface, "WriteLatency", NULL);
+    }
+}
+
+/* 
+ * Scan sysfs backlights: list them and cache first internal backlight name.
+ * If export is true, every device is exported too, 
+ * so that bus clients can be notified about their changes.
+ */
+static void scan_internal_devs(const bool export) {
+    default_bl[0] = '\0';
+    free(sysfs_devs);
+    sysfs_devs = NULL;
+    num_sysfs_devs = 0;
+    
+    struct udev_enumerate *enumerate = udev_enumerate_new(udev);
+    udev_enumerate_add_match_subsystem(enumerate, "backlight");
+    udev_enumerate_scan_devices(enumerate);
+    struct udev_list_entry *entry;
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+        struct udev_device *dev = udev_device_new_from_syspath(udev, udev_list_entry_get_name(entry));
+        if (dev) {
+            const int busno = get_ddcci_busno(dev);
+            sysfs_backlight *tmp = realloc(sysfs_devs, sizeof(sysfs_backlight) * (num_sysfs_devs + 1));
+            if (tmp) {
+                sysfs_devs = tmp;
+                sysfs_backlight *b = &sysfs_devs[num_sysfs_devs++];
+                memset(b, 0, sizeof(sysfs_backlight));
+                strncpy(b->sysname, udev_device_get_sysname(dev), sizeof(b->sysname) - 1);
+                b->busno = busno;
+                if (busno < 0) {
+                    get_panel_parent(dev, b);
+                }
+            }
+            if (export) {
+                add_internal_dev(dev);
+            }
+            udev_device_unref(dev);
+        }
+    }
+    udev_enumerate_unref(enumerate);
+    mark_shadowed_devs();
+    for (int i = 0; i < num_sysfs_devs && !strlen(default_bl); i++) {
+        if (sysfs_devs[i].busno < 0 && !sysfs_devs[i].shadowed) {
+            strncpy(default_bl, sysfs_devs[i].sysname, sizeof(default_bl) - 1);
+        }
+    }
+    refresh_ddcci_coverage();
+}
+
+/* Returns i2c bus number of the monitor if dev is a ddcci kernel driver backlight; -1 otherwise */
+static int get_ddcci_busno(struct udev_device *dev) {
+    int busno = -1;
+    struct udev_device *parent = udev_device_get_parent_with_subsystem_devtype(dev, "ddcci", NULL);
+    if (parent && sscanf(udev_device_get_sysname(parent), "ddcci%d", &busno) != 1) {
+        busno = -1;
+    }
+    return busno;
+}
+
+/* 
+ * Same panel may be exposed by many backlights (eg: acpi_video0 and intel_backlight): 
+ * they are told apart by the pci device (or parent device) driving them, 
+ * and ranked by their type, as kernel suggests: raw > platform > firmware.
+ */
+static void get_panel_parent(struct udev_device *dev, sysfs_backlight *b) {
+    static const char *types[] = { "raw", "platform", "firmware" };
+    
+    struct udev_device *parent = udev_device_get_parent_with_subsystem_devtype(dev, "pci", NULL);
+    if (!parent) {
+        parent = udev_device_get_parent(dev);
+    }
+    if (parent) {
+        strncpy(b->parent, udev_device_get_syspath(parent), sizeof(b->parent) - 1);
+    }
+    
+    const char *type = udev_device_get_sysattr_value(dev, "type");
+    const int num_types = sizeof(types) / sizeof(*types);
+    b->type = num_types;
+    for (int i = 0; i < num_types && type; i++) {
+        if (!strcmp(type, types[i])) {
+            b->type = i;
+            break;
+        }
+    }
+}
+
+/* Mark internal backlights whose panel is driven by another, preferred, one too */
+static void mark_shadowed_devs(void) {
+    for (int i = 0; i < num_sysfs_devs; i++) {
+        sysfs_backlight *b = &sysfs_devs[i];
+        for (int j = 0; j < num_sysfs_devs && b->busno < 0 && strlen(b->parent); j++) {
+            const sysfs_backlight *o = &sysfs_devs[j];
+            if (o->busno < 0 && o->type < b->type && !strcmp(o->parent, b->parent)) {
+                b->shadowed = true;
+                break;
+            }
+        }
+    }
+}
+
+static void add_internal_dev(struct udev_device *dev) {
+    const char *val = udev_device_get_sysattr_value(dev, "brightness");
+    const char *max = udev_device_get_sysattr_value(dev, "max_brightness");
+    backlight_dev *b = get_backlight_dev(udev_device_get_sysname(dev));
+    if (b && val && max) {
+        update_backlight_dev(b, atoi(val), atoi(max));
+    }
+}
+
+/* Only known devices are exported; external ones only while they are connected */
+static bool is_exported(const backlight_dev *dev) {
+    if (!dev || dev->max <= 0) {
+        return false;
+    }
+#ifdef DDC_PRESENT
+    if (dev->external) {
+        ddc_display *d = get_ddc_display(dev->id);
+        return d && !strlen(d->ddcci);
+    }
+#endif
+    return true;
+}
+
+static int find_backlight_dev(sd_bus *b, const char *path, const char *interface, void *userdata, 
+                              void **found, sd_bus_error *ret_error) {
+    char *id = NULL;
+    int r = sd_bus_path_decode(path, object_path, &id);
+    if (r <= 0) {
+        return r;
+    }
+    backlight_dev *dev = map_get(devices, id);
+    free(id);
+    if (!is_exported(dev)) {
+        return 0;
+    }
+    *found = dev;
+    return 1;
+}
+
+static map_ret_code append_dev_node(void *userdata, const char *key, void *data) {
+    node_list *l = (node_list *)userdata;
+    backlight_dev *dev = (backlight_dev *)data;
+    if (dev->path && is_exported(dev)) {
+        l->nodes[l->num++] = strdup(dev->path);
+    }
+    return MAP_OK;
+}
+
+static int enumerate_backlight_devs(sd_bus *b, const char *prefix, void *userdata, 
+                                    char ***nodes, sd_bus_error *ret_error) {
+    node_list l = { calloc(map_length(devices) + 1, sizeof(char *)), 0 };
+    if (!l.nodes) {
+        return -ENOMEM;
+    }
+    map_iterate(devices, append_dev_node, &l);
+    *nodes = l.nodes;
+    return 1;
+}
+
+static int get_dev_brightness(sd_bus *b, const char *path, const char *interface, const char *property,
+                              sd_bus_message *reply, void *userdata, sd_bus_error *error) {
+    backlight_dev *dev = (backlight_dev *)userdata;
+    if (dev->curr < 0) {
+        sd_bus_error_set_errno(error, ENODATA);
+        return -ENODATA;
+    }
+    return sd_bus_message_append(reply, "d", (double)dev->curr / dev->max);
+}
+
+static int get_dev_latency(sd_bus *b, const char *path, const char *interface, const char *property,
+                           sd_bus_message *reply, void *userdata, sd_bus_error *error) {
+    backlight_dev *dev = (backlight_dev *)userdata;
+    return sd_bus_message_append(reply, "u", (uint32_t)(dev->latency + 0.5));
+}
+
+static bool is_cached(const backlight_dev *dev) {
+    if (!dev || dev->curr < 0 || dev->max <= 0) {
+        return false;
+    }
+    return !dev->external || now_ms() - dev->ts < conf.ddc_cache_ttl;
+}
+
+/* Refresh shadow of an internal backlight if it was changed by someone else */
+static void receive_backlight_change(void) {
+    struct udev_device *dev = NULL;
+    receive_udev_device(&dev, bl_mon_handler);
+    if (dev) {
+        const char *sysname = udev_device_get_sysname(dev);
+        const char *action = udev_device_get_action(dev);
+        if (action && strcmp(action, "change")) {
+            /* Added or removed device: rescan first internal backlight and ddcci ones */
+            map_remove(devices, sysname);
+            if (!strcmp(action, "add")) {
+                add_internal_dev(dev);
+            }
+            scan_internal_devs(false);
+        } else {
+            backlight_dev *b = map_get(devices, sysname);
+            const char *val = udev_device_get_sysattr_value(dev, "brightness");
+            if (b) {
+                update_backlight_dev(b, val ? atoi(val) : -1, 0);
+            }
+        }
+        udev_device_unref(dev);
+    }
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int open_internal_backlight(smooth_client *sc) {
+    int r = -ENODEV;
+    
+    struct udev_device *dev = NULL;
+    get_udev_device(sc->d.sn, "backlight", NULL, NULL, &dev);
+    if (dev) {
+        char path[PATH_MAX + 1] = {0};
+        snprintf(path, sizeof(path) - 1, "%s/brightness", udev_device_get_syspath(dev));
+        sc->br_fd = open(path, O_RDWR | O_CLOEXEC);
+        sc->br_max = atoi(udev_device_get_sysattr_value(dev, "max_brightness"));
+        r = sc->br_fd >= 0 ? 0 : -errno;
+        udev_device_unref(dev);
+    }
+    return r;
+}
+
+static int set_internal_backlight(smooth_client *sc) {
+    if (sc->br_fd == -1) {
+        /* Do not look it up again if it was already found not to be an internal interface */
+        int r = sc->d.external ? -ENODEV : open_internal_backlight(sc);
+        if (r < 0) {
+            sc->d.external = r == -ENODEV;
+            return r;
+        }
+    }
+    
+    char val[15] = {0};
+    backlight_dev *dev = get_backlight_dev(sc->d.sn);
+    if (!dev) {
+        return -ENOMEM;
+    }
+    /* Only read back hardware value when it is not known */
+    if (dev->curr < 0) {
+        const ssize_t len = pread(sc->br_fd, val, sizeof(val) - 1, 0);
+        if (len <= 0) {
+            return len < 0 ? -errno : -EIO;
+        }
+        update_backlight_dev(dev, atoi(val), sc->br_max);
+    }
+    
+    int value = next_backlight_level(sc, dev->curr, sc->br_max) * sc->br_max;
+    /* Skip writes that would not change anything */
+    if (value != dev->curr) {
+        const int len = snprintf(val, sizeof(val), "%d", value);
+        const uint64_t start = stats_now();
+        const bool written = pwrite(sc->br_fd, val, len, 0) == len;
+        const uint64_t us = stats_record_op(STATS_SYSFS_WRITE, start, !written);
+        USDT(backlight__sysfs_write, sc->d.sn, value, sc->br_max, us);
+        if (!written) {
+            dev->curr = -1;
+            return -errno;
+        }
+        update_backlight_dev(dev, value, sc->br_max);
+    }
+    return 0;
+}
+
+/* 
+ * Queue next step on a ddc worker. 
+ * Returns 1 if an op is in flight, 0 if there was nothing to write, -1 on error.
+ */
+static int set_external_backlight(smooth_client *sc) {
+    int ret = -1;
+#ifdef DDC_PRESENT
+    if (sc->in_flight) {
+        /* Previous op will schedule next step once completed */
+        return 1;
+    }
+    
+    if (!sc->held) {
+        /* Hold display on first step; its handle is then kept open until client is destroyed */
+        ret = submit_ddc_op(DDC_HOLD, sc->d.sn, 0, on_ddc_step_done, sc);
+    } else {
+        backlight_dev *dev = get_backlight_dev(sc->d.sn);
+        if (!dev) {
+            return -1;
+        }
+        int new_value = next_backlight_level(sc, dev->curr, dev->max) * dev->max;
+        /* Skip writes that would not change anything */
+        if (new_value == dev->curr) {
+            return 0;
+        }
+        ret = submit_ddc_op(DDC_WRITE, sc->d.sn, new_value, on_ddc_step_done, sc);
+    }
+    if (ret == 0) {
+        sc->in_flight = true;
+        ret = 1;
+    } else {
+        ret = -1;
+    }
+#endif
+    return ret;
+}
+
+/**
+ * Backlight pct getter method: for each screen (both internal and external)
+ * it founds, it will return a "(uid, current backlight pct)" struct.
+ * Note that for internal laptop screen, uid = syspath (eg: intel_backlight)
+ * External screens are read in parallel by ddc workers: 
+ * reply is sent once all of them completed.
+ */
+static int method_getallbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    const char *backlight_interface = NULL;
+
+    int r = sd_bus_message_read(m, "s", &backlight_interface);
+    if (r >= 0) {
+        COALESCE(m);
+        get_request *req = calloc(1, sizeof(get_request));
+        if (!req) {
+            coalesce_send_errno(m, ENOMEM);
+            return 1;
+        }
+        req->m = sd_bus_message_ref(m);
+        req->array = true;
+        sd_bus_message_new_method_return(m, &req->reply);
+        sd_bus_message_open_container(req->reply, SD_BUS_TYPE_ARRAY, "(sd)");
+
+        /* Every sysfs backlight, or only required internal one plus ddcci ones */
+        if (backlight_interface && strlen(backlight_interface)) {
+            if (append_internal_backlight(req->reply, backlight_interface) == 0) {
+                req->found++;
+            }
+            DDCCI_FOREACH({
+                if (strcmp(id, backlight_interface) && append_internal_backlight(req->reply, id) == 0) {
+                    req->found++;
+                }
+            });
+        } else {
+            SYSFS_FOREACH({
+                if (append_internal_backlight(req->reply, id) == 0) {
+                    req->found++;
+                }
+            });
+        }
+        append_external_backlight(req, NULL);
+        complete_get_request(req);
+        r = 1;
+    }
+    return r;
+}
+
+/* Send reply once no more ddc reads are pending */
+static void complete_get_request(get_request *req) {
+    if (req->pending > 0) {
+        return;
+    }
+    
+    if (req->found) {
+        if (req->array) {
+            sd_bus_message_close_container(req->reply);
+        }
+        coalesce_send(req->m, req->reply);
+    } else {
+        coalesce_send_errno(req->m, ENODEV);
+    }
+    sd_bus_message_unref(req->reply);
+    sd_bus_message_unref(req->m);
+    free(req);
+}
+
+static void append_backlight(sd_bus_message *reply, const char *name, const double pct) {
+    sd_bus_message_open_container(reply, SD_BUS_TYPE_STRUCT, "sd");
+    sd_bus_message_append(reply, "sd", name, pct);
+    sd_bus_message_close_container(reply);
+}
+
+static int append_internal_backlight(sd_bus_message *reply, const char *path) {
+    int ret = -1;
+    
+    const char *name = path && strlen(path) ? path : default_bl;
+    if (strrchr(name, '/')) {
+        name = strrchr(name, '/') + 1;
+    }
+    if (!strlen(name)) {
+        return ret;
+    }
+    
+    /* Serve it from cache if possible */
+    backlight_dev *b = map_get(devices, name);
+    if (is_cached(b)) {
+        append_backlight(reply, name, (double)b->curr / b->max);
+        return 0;
+    }
+    
+    struct udev_device *dev = NULL;
+    get_udev_device(name, "backlight", NULL, NULL, &dev);
+
+    if (dev) {
         int val = atoi(udev_device_get_sysattr_value(dev, "brightness"));
         int max = atoi(udev_device_get_sysattr_value(dev, "max_brightness"));
 
         double pct = (double)val / max;
         append_backlight(reply, udev_device_get_sysname(dev), pct);
+        
+        b = get_backlight_dev(udev_device_get_sysname(dev));
+        if (b) {
+            update_backlight_dev(b, val, max);
+        }
         udev_device_unref(dev);
         ret = 0;
     }
     return ret;
 }
 
-static int append_external_backlight(sd_bus_message *reply, const char *sn) {
-    int ret = -1;
+/* Queue a ddc read for sn, or for each registered display if sn is NULL */
+static void append_external_backlight(get_request *req, const char *sn) {
+#ifdef DDC_PRESENT
     if (sn) {
-        DDCUTIL_FUNC(sn, {
-            ret = 0;
-            append_backlight(reply, sn, (double)VALREC_CUR_VAL(valrec) / VALREC_MAX_VAL(valrec));
-        });
+        if (submit_ddc_op(DDC_READ, sn, 0, on_ddc_get_done, req) == 0) {
+            req->pending++;
+        }
+    } else if (!ddc_detected) {
+        /* Wait for displays detection to complete */
+        get_request **tmp = realloc(waiting_gets, sizeof(get_request *) * (num_waiting_gets + 1));
+        if (tmp) {
+            waiting_gets = tmp;
+            waiting_gets[num_waiting_gets++] = req;
+            req->pending++;
+        }
     } else {
-        DDCUTIL_LOOP({
-            ret = 0;
-            append_backlight(reply, id, (double)VALREC_CUR_VAL(valrec) / VALREC_MAX_VAL(valrec));
+        DDCUTIL_FOREACH({
+            backlight_dev *b = map_get(devices, id);
+            if (is_cached(b)) {
+                append_backlight(req->reply, id, (double)b->curr / b->max);
+                req->found++;
+            } else if (submit_ddc_op(DDC_READ, id, 0, on_ddc_get_done, req) == 0) {
+                req->pending++;
+            }
         });
     }
-    return ret;
+#endif
 }
 
+/* Verse must outlive the call, as it is passed again to suspended method once polkit authorizes it */
 static int method_raiseallbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-    int verse = 1;
+    static int verse = 1;
     return method_setallbrightness(m, &verse, ret_error);
 }
 
 static int method_lowerallbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-    int verse = -1;
+    static int verse = -1;
     return method_setallbrightness(m, &verse, ret_error);
 }
 
 static int method_setbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-    if (!check_authorization(m)) {
-        sd_bus_error_set_errno(ret_error, EPERM);
-        return -EPERM;
-    }
+    ASSERT_AUTH(m, method_setbrightness, userdata, ret_error);
     
     const char *serial = NULL;
     double target_pct, smooth_step;
@@ -477,33 +1620,16 @@ static int method_setbrightness(sd_bus_message *m, void *userdata, sd_bus_error
     int r = sd_bus_message_read(m, "d(bdu)s", &target_pct, &is_smooth, &smooth_step,
                                 &smooth_wait, &serial);
     if (r >= 0) {
-        /** Sanity checks **/
-        if (target_pct > 1.0) {
-            target_pct = 1.0;
-        } else if (target_pct < 0.0) {
-            target_pct = 0.0;
-        }
-        
-        if (smooth_step > 1.0) {
-            smooth_step = 1.0;
-        } else if (smooth_step <= 0.0) {
-            smooth_step = 0.0; // disable smoothing
-        }
-        /** End of sanity checks **/
+        sanitize_transition(&target_pct, &smooth_step);
         
         if (serial && strlen(serial)) {
+            serial = get_ddcci_sn(serial);
             int verse = 0;
             if (userdata) {
                 verse = *((int *)userdata);
             }
             
-            smooth_client *sc = map_get(running_clients, serial);
-            if (!sc) {
-                // we do not know if this is an internal backlight, skip check (passing 0 as last param)
-                add_backlight_sn(target_pct, is_smooth, smooth_step, smooth_wait, verse, serial, 0);
-            } else {
-                reset_backlight_struct(sc, target_pct, is_smooth, smooth_step, smooth_wait, verse);
-            }
+            set_backlight_sn(target_pct, is_smooth, smooth_step, smooth_wait, verse, serial);
             // Returns true if no errors happened;
             r = sd_bus_reply_method_return(m, "b", true);
         } else {
@@ -514,24 +1640,166 @@ static int method_setbrightness(sd_bus_message *m, void *userdata, sd_bus_error
     return r;
 }
 
+/* Start (or restart, if already running) a transition on sn */
+static void set_backlight_sn(double target_pct, int is_smooth, double smooth_step, 
+                             unsigned int smooth_wait, int verse, const char *sn) {
+    smooth_client *sc = map_get(running_clients, sn);
+    if (!sc) {
+        // we do not know if this is an internal backlight, skip check (passing 0 as last param)
+        add_backlight_sn(target_pct, is_smooth, smooth_step, smooth_wait, verse, sn, 0);
+    } else if (!retarget_client(sc, target_pct, verse)) {
+        reset_backlight_struct(sc, target_pct, is_smooth, smooth_step, smooth_wait, verse);
+    }
+}
+
+/* 
+ * Start a new transition for sn, unless it is a relative request retargeting a running one.
+ * Returns the new client, if any.
+ */
+static smooth_client *start_backlight_sn(double target_pct, int is_smooth, double smooth_step, 
+                                         unsigned int smooth_wait, int verse, const char *sn, bool internal) {
+    smooth_client *sc = map_get(running_clients, sn);
+    if (sc) {
+        if (retarget_client(sc, target_pct, verse)) {
+            return NULL;
+        }
+        map_remove(running_clients, sn);
+    }
+    return add_backlight_sn(target_pct, is_smooth, smooth_step, smooth_wait, verse, sn, internal);
+}
+
+/*
+ * Accumulate a relative request (eg: hotkeys Raise/Lower with key-repeat) into a running transition:
+ * its target is moved, while its pace and timer are kept, so that write rate stays bounded
+ * and hardware is not read again.
+ * Transitions that did not step yet (eg: while a ddc display is being held) have their delta accumulated instead.
+ * Returns false if sc has no running transition or request is absolute.
+ */
+static bool retarget_client(smooth_client *sc, double target_pct, int verse) {
+    if (verse == 0 || sc->d.reached_target) {
+        return false;
+    }
+    
+    if (sc->start_pct < 0) {
+        if (sc->verse != verse) {
+            return false;
+        }
+        sc->target_pct += target_pct;
+        if (sc->target_pct > 1.0) {
+            sc->target_pct = 1.0;
+        }
+        return true;
+    }
+    
+    sc->end_pct += verse * target_pct;
+    if (sc->end_pct > 1.0) {
+        sc->end_pct = 1.0;
+    } else if (sc->end_pct < 0.0) {
+        sc->end_pct = 0.0;
+    }
+    if (sc->duration > 0) {
+        /* Interpolate toward new target from current level */
+        sc->start_pct = sc->pct;
+        sc->start_ts = now_ms();
+    }
+    return true;
+}
+
+static void sanitize_transition(double *target_pct, double *smooth_step) {
+    if (*target_pct > 1.0) {
+        *target_pct = 1.0;
+    } else if (*target_pct < 0.0) {
+        *target_pct = 0.0;
+    }
+    
+    if (*smooth_step > 1.0) {
+        *smooth_step = 1.0;
+    } else if (*smooth_step <= 0.0) {
+        *smooth_step = 0.0; // disable smoothing
+    }
+}
+
+/*
+ * Set many backlights with a single authorization.
+ * All targets are validated first; valid ones are then started together,
+ * thus their first steps are run in the same timer wakeup.
+ * Returns a boolean for each requested device, in order: 
+ * false if its id is empty or it is not a known backlight device.
+ */
+static int method_setmanybrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    ASSERT_AUTH(m, method_setmanybrightness, userdata, ret_error);
+    
+    set_request *reqs = NULL;
+    int num_reqs = 0;
+    int r = sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "(sd(bdu))");
+    while (r >= 0) {
+        set_request req = {0};
+        r = sd_bus_message_read(m, "(sd(bdu))", &req.sn, &req.target_pct, &req.is_smooth, 
+                                &req.smooth_step, &req.smooth_wait);
+        if (r <= 0) {
+            break;
+        }
+        set_request *tmp = realloc(reqs, sizeof(set_request) * (num_reqs + 1));
+        if (!tmp) {
+            r = -ENOMEM;
+            break;
+        }
+        reqs = tmp;
+        
+        sanitize_transition(&req.target_pct, &req.smooth_step);
+        if (req.sn && strlen(req.sn)) {
+            req.sn = get_ddcci_sn(req.sn);
+            req.valid = is_exported(map_get(devices, req.sn));
+        }
+        reqs[num_reqs++] = req;
+    }
+    if (r >= 0) {
+        r = sd_bus_message_exit_container(m);
+    }
+    
+    if (r >= 0) {
+        sd_bus_message *reply = NULL;
+        sd_bus_message_new_method_return(m, &reply);
+        sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "b");
+        for (int i = 0; i < num_reqs; i++) {
+            set_request *req = &reqs[i];
+            if (req->valid) {
+                set_backlight_sn(req->target_pct, req->is_smooth, req->smooth_step, req->smooth_wait, 0, req->sn);
+            }
+            sd_bus_message_append(reply, "b", req->valid);
+        }
+        sd_bus_message_close_container(reply);
+        m_log("Set %d backlights.\n", num_reqs);
+        r = sd_bus_send(NULL, reply, NULL);
+        sd_bus_message_unref(reply);
+    } else {
+        sd_bus_error_set_errno(ret_error, -r);
+    }
+    free(reqs);
+    return r;
+}
+
 static int method_getbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
    const char *sn = NULL;
    int r = sd_bus_message_read(m, "s", &sn);
     if (r >= 0) {
         if (sn && strlen(sn)) {
-            sd_bus_message *reply = NULL;
-            sd_bus_message_new_method_return(m, &reply);
-            r = 0;
-            if (append_internal_backlight(reply, sn) == -1) {
-                if (append_external_backlight(reply, sn) == -1) {
-                    sd_bus_error_set_errno(ret_error, ENODEV);
-                    r = -ENODEV;
-                }
+            COALESCE(m);
+            sn = get_ddcci_sn(sn);
+            get_request *req = calloc(1, sizeof(get_request));
+            if (!req) {
+                coalesce_send_errno(m, ENOMEM);
+                return 1;
             }
-            if (!r) {
-                r = sd_bus_send(NULL, reply, NULL);
+            req->m = sd_bus_message_ref(m);
+            sd_bus_message_new_method_return(m, &req->reply);
+            if (append_internal_backlight(req->reply, sn) == 0) {
+                req->found++;
+            } else {
+                append_external_backlight(req, sn);
             }
-            sd_bus_message_unref(reply);
+            complete_get_request(req);
+            r = 1;
         } else {
             sd_bus_error_set_errno(ret_error, EINVAL);
             r = -EINVAL;
@@ -541,11 +1809,609 @@ static int method_getbrightness(sd_bus_message *m, void *userdata, sd_bus_error
 }
 
 static int method_raisebrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-    int verse = 1;
+    static int verse = 1;
     return method_setbrightness(m, &verse, ret_error);
 }
 
 static int method_lowerbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-    int verse = -1;
+    static int verse = -1;
     return method_setbrightness(m, &verse, ret_error);
 }
+
+#ifdef DDC_PRESENT
+
+/* 
+ * Detect ddc displays on a ddc worker, as it can take some seconds:
+ * meanwhile, requests are served for internal backlights, while ddc ops wait for it to end.
+ */
+static void start_ddc_detection(void) {
+    if (detection) {
+        ddc_redetect = true;
+        return;
+    }
+    
+    detection = calloc(1, sizeof(ddc_detection));
+    if (!detection) {
+        return;
+    }
+    detection->known = malloc(sizeof(ddc_display) * num_ddc_displays);
+    if (detection->known) {
+        memcpy(detection->known, ddc_displays, sizeof(ddc_display) * num_ddc_displays);
+        detection->num_known = num_ddc_displays;
+    }
+    if (worker_pool_submit(ddc_pool, "ddc_detection", detect_ddc_displays, on_ddc_detected, NULL, detection) < 0) {
+        /* No workers: detect synchronously */
+        detect_ddc_displays(detection);
+        on_ddc_detected(detection);
+    }
+}
+
+/* Run by a ddc worker, once no op is running on other ones */
+static void detect_ddc_displays(void *data) {
+    ddc_detection *det = (ddc_detection *)data;
+    
+    pthread_rwlock_wrlock(&ddc_lock);
+    ddca_set_sleep_multiplier(1.0);
+    ddca_enable_verify(false);
+    DDCA_Display_Info_List *dlist = NULL;
+    ddca_get_display_info_list2(false, &dlist);
+    if (dlist) {
+        det->displays = calloc(dlist->ct, sizeof(ddc_display));
+        det->curr = calloc(dlist->ct, sizeof(int));
+        for (int ndx = 0; ndx < dlist->ct && det->displays && det->curr; ndx++) {
+            DDCA_Display_Info *dinfo = &dlist->info[ndx];
+            ddc_display *d = &det->displays[det->num_displays];
+            get_info_id(d->id, sizeof(d->id), dinfo);
+            d->dref = dinfo->dref;
+            d->busno = dinfo->path.io_mode == DDCA_IO_I2C ? dinfo->path.path.i2c_busno : -1;
+            
+            ddc_display *old = NULL;
+            for (int i = 0; i < det->num_known && !old; i++) {
+                if (!strcmp(det->known[i].id, d->id)) {
+                    old = &det->known[i];
+                }
+            }
+            if (old) {
+                /* Its tuning state is refreshed from live registry once published */
+                d->max = old->max;
+                d->sleep_mult = old->sleep_mult;
+                d->good_mult = old->good_mult;
+                d->verified = old->verified;
+                d->tuned = old->tuned;
+                d->writes = old->writes;
+                det->curr[det->num_displays++] = -1;
+                continue;
+            }
+            
+            DDCA_Display_Handle dh = NULL;
+            if (ddca_open_display2(dinfo->dref, false, &dh)) {
+                continue;
+            }
+            DDCA_Any_Vcp_Value *valrec;
+            if (!ddca_get_any_vcp_value_using_explicit_type(dh, br_code, DDCA_NON_TABLE_VCP_VALUE, &valrec)) {
+                d->max = VALREC_MAX_VAL(valrec);
+                det->curr[det->num_displays++] = VALREC_CUR_VAL(valrec);
+                ddca_free_any_vcp_value(valrec);
+            }
+            ddca_close_display(dh);
+        }
+        ddca_free_display_info_list(dlist);
+    }
+    pthread_rwlock_unlock(&ddc_lock);
+}
+
+/* Publish detected displays, then serve requests that were waiting for them */
+static void on_ddc_detected(void *data) {
+    ddc_detection *det = (ddc_detection *)data;
+    
+    /* Known displays may have been tuned meanwhile: keep their live tuning state */
+    for (int i = 0; i < det->num_displays; i++) {
+        const ddc_display *live = det->curr[i] < 0 ? get_ddc_display(det->displays[i].id) : NULL;
+        if (live) {
+            ddc_display *d = &det->displays[i];
+            d->sleep_mult = live->sleep_mult;
+            d->good_mult = live->good_mult;
+            d->verified = live->verified;
+            d->tuned = live->tuned;
+            d->writes = live->writes;
+        }
+    }
+    free(ddc_displays);
+    ddc_displays = det->displays;
+    num_ddc_displays = det->num_displays;
+    det->displays = NULL;
+    
+    transition_group *g = deferred_set.valid ? new_group() : NULL;
+    for (int i = 0; i < num_ddc_displays; i++) {
+        ddc_display *d = &ddc_displays[i];
+        if (det->curr[i] < 0) {
+            continue;
+        }
+        
+        /* Newly probed display */
+        double *stored = map_get(ddc_sleep_mults, d->id);
+        d->sleep_mult = stored ? *stored : 1.0;
+        d->good_mult = d->sleep_mult;
+        d->tuned = stored != NULL;
+        
+        /* Export it */
+        backlight_dev *dev = get_backlight_dev(d->id);
+        if (dev) {
+            dev->external = true;
+            update_backlight_dev(dev, det->curr[i], d->max);
+        }
+    }
+    refresh_ddcci_coverage();
+    m_log("%d ddc displays registered.\n", num_ddc_displays);
+    
+    /* Apply SetAll to displays that were not known when it was issued */
+    if (deferred_set.valid) {
+        for (int i = 0; i < num_ddc_displays; i++) {
+            const ddc_display *d = &ddc_displays[i];
+            if (det->curr[i] >= 0 && !strlen(d->ddcci) && !map_has_key(running_clients, d->id)) {
+                join_group(g, add_backlight_sn(deferred_set.target_pct, deferred_set.is_smooth, 
+                                               deferred_set.smooth_step, deferred_set.smooth_wait, 
+                                               deferred_set.verse, d->id, false));
+            }
+        }
+        start_group(g);
+        deferred_set.valid = false;
+    }
+    
+    detection = NULL;
+    free_ddc_detection(det);
+    ddc_detected = true;
+    for (int i = 0; i < num_waiting_gets; i++) {
+        get_request *req = waiting_gets[i];
+        req->pending--;
+        append_external_backlight(req, NULL);
+        complete_get_request(req);
+    }
+    free(waiting_gets);
+    waiting_gets = NULL;
+    num_waiting_gets = 0;
+    
+    if (ddc_redetect) {
+        ddc_redetect = false;
+        start_ddc_detection();
+    }
+}
+
+static void free_ddc_detection(ddc_detection *det) {
+    free(det->known);
+    free(det->displays);
+    free(det->curr);
+    free(det);
+}
+
+/* Called by SetAll, once it started a transition on every known display */
+static void defer_ddc_setall(double target_pct, int is_smooth, double smooth_step, 
+                             unsigned int smooth_wait, int verse) {
+    deferred_set.valid = detection != NULL;
+    if (deferred_set.valid) {
+        deferred_set.target_pct = target_pct;
+        deferred_set.is_smooth = is_smooth;
+        deferred_set.smooth_step = smooth_step;
+        deferred_set.smooth_wait = smooth_wait;
+        deferred_set.verse = verse;
+    }
+}
+
+/* Mark registered displays that are driven by ddcci kernel driver */
+static void refresh_ddcci_coverage(void) {
+    for (int i = 0; i < num_ddc_displays; i++) {
+        ddc_display *d = &ddc_displays[i];
+        d->ddcci[0] = '\0';
+        for (int j = 0; j < num_sysfs_devs && d->busno >= 0; j++) {
+            if (sysfs_devs[j].busno == d->busno) {
+                strncpy(d->ddcci, sysfs_devs[j].sysname, sizeof(d->ddcci) - 1);
+                break;
+            }
+        }
+    }
+}
+
+static void init_ddc(void) {
+    load_sleep_mults();
+    drm_mon_fd = init_udev_monitor("drm", &drm_mon_handler);
+    i2c_mon_fd = init_udev_monitor("i2c", &i2c_mon_handler);
+    m_register_fd(drm_mon_fd, false, NULL);
+    m_register_fd(i2c_mon_fd, false, NULL);
+    
+    ddc_handles = map_new(true, free);
+    ddc_pool = worker_pool_new(num_ddc_workers);
+    if (ddc_pool) {
+        m_register_fd(worker_pool_get_fd(ddc_pool), false, NULL);
+    } else {
+        m_log("Failed to create ddc workers.\n");
+    }
+    start_ddc_detection();
+}
+
+static void receive_ddc(const int fd) {
+    if (fd == worker_pool_get_fd(ddc_pool)) {
+        worker_pool_dispatch(ddc_pool);
+        return;
+    }
+    
+    const int handler = fd == drm_mon_fd ? drm_mon_handler : i2c_mon_handler;
+    
+    /* 
+     * Drain any pending event, then rebuild registry once.
+     * Note that ddcutil 0.9.x only detects displays once per process: 
+     * displays attached later are not found until clightd is restarted.
+     */
+    struct udev_device *dev = NULL;
+    do {
+        receive_udev_device(&dev, handler);
+        if (dev) {
+            udev_device_unref(dev);
+        }
+    } while (dev);
+    start_ddc_detection();
+}
+
+static map_ret_code close_ddc_handle(void *userdata, const char *key, void *data) {
+    ddc_handle *h = (ddc_handle *)data;
+    ddca_close_display(h->dh);
+    return MAP_OK;
+}
+
+static void destroy_ddc(void) {
+    /* 
+     * Pending ops are cancelled by on_ddc_op_cancel(), instead of being completed:
+     * orphaned clients are freed here, running ones are then freed straight away; 
+     * displays they held are closed below.
+     * A pending detection is not owned by the pool: it is freed here.
+     */
+    worker_pool_free(ddc_pool);
+    ddc_pool = NULL;
+    for (int i = 0; i < num_orphans; i++) {
+        free(orphans[i]->d.sn);
+        free(orphans[i]);
+    }
+    free(orphans);
+    orphans = NULL;
+    num_orphans = 0;
+    if (detection) {
+        /* Its done callback won't be called anymore: reply to waiting requests with what we have */
+        ddc_detected = true;
+        for (int i = 0; i < num_waiting_gets; i++) {
+            waiting_gets[i]->pending--;
+            complete_get_request(waiting_gets[i]);
+        }
+        free(waiting_gets);
+        waiting_gets = NULL;
+        num_waiting_gets = 0;
+        free_ddc_detection(detection);
+        detection = NULL;
+    }
+    map_iterate(ddc_handles, close_ddc_handle, NULL);
+    map_free(ddc_handles);
+    map_free(ddc_sleep_mults);
+    
+    free(ddc_displays);
+    ddc_displays = NULL;
+    num_ddc_displays = 0;
+}
+
+static void load_sleep_mults(void) {
+    ddc_sleep_mults = map_new(true, free);
+    FILE *f = fopen(ddc_state_file, "r");
+    if (f) {
+        char id[32];
+        double mult;
+        while (fscanf(f, "%lf %31[^\n]\n", &mult, id) == 2) {
+            double *val = malloc(sizeof(double));
+            if (val && mult >= DDC_MIN_SLEEP_MULT && mult <= 1.0) {
+                *val = mult;
+                map_put(ddc_sleep_mults, id, val);
+            } else {
+                free(val);
+            }
+        }
+        fclose(f);
+    }
+}
+
+static map_ret_code write_sleep_mult(void *userdata, const char *key, void *data) {
+    fprintf((FILE *)userdata, "%.3lf %s\n", *(double *)data, key);
+    return MAP_OK;
+}
+
+/* Atomically replace state file */
+static void store_sleep_mults(void) {
+    char tmp[PATH_MAX + 1];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", ddc_state_file);
+    mkdir(ddc_state_dir, 0755);
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        m_log("Failed to store ddc sleep multipliers: %s\n", strerror(errno));
+        return;
+    }
+    map_iterate(ddc_sleep_mults, write_sleep_mult, f);
+    if (fclose(f) == 0) {
+        rename(tmp, ddc_state_file);
+    } else {
+        unlink(tmp);
+    }
+}
+
+/*
+ * Called on each write completion.
+ * While not tuned, writes are verified and sleep multiplier is lowered after DDC_PROBE_WRITES successful ones;
+ * on first failure last reliable one is restored and stored.
+ * Once tuned, failures (including dropped writes caught by sampled verifications) raise it back again.
+ * Returns true if multiplier was raised, ie: failed write is worth a retry.
+ */
+static bool tune_sleep_mult(const ddc_op *op) {
+    ddc_display *d = get_ddc_display(op->id);
+    if (!d) {
+        return false;
+    }
+    if (op->sleep_mult != d->sleep_mult) {
+        /* Multiplier changed while op was in flight */
+        return op->rc != 0;
+    }
+    
+    if (!op->rc) {
+        if (!d->tuned && ++d->verified == DDC_PROBE_WRITES) {
+            d->good_mult = d->sleep_mult;
+            d->verified = 0;
+            if (d->sleep_mult > DDC_MIN_SLEEP_MULT) {
+                d->sleep_mult /= 2;
+                if (d->sleep_mult < DDC_MIN_SLEEP_MULT) {
+                    d->sleep_mult = DDC_MIN_SLEEP_MULT;
+                }
+            } else {
+                d->tuned = true;
+            }
+        } else {
+            return false;
+        }
+    } else if (d->sleep_mult < 1.0) {
+        if (!d->tuned) {
+            d->sleep_mult = d->good_mult;
+            d->tuned = true;
+        } else {
+            d->sleep_mult = d->sleep_mult * 2 > 1.0 ? 1.0 : d->sleep_mult * 2;
+        }
+        d->verified = 0;
+    } else {
+        /* Failures with default sleeps are not caused by them */
+        return false;
+    }
+    
+    if (d->tuned) {
+        double *val = map_get(ddc_sleep_mults, d->id);
+        if (!val) {
+            val = malloc(sizeof(double));
+            if (!val) {
+                return op->rc != 0;
+            }
+            map_put(ddc_sleep_mults, d->id, val);
+        }
+        if (*val != d->sleep_mult) {
+            *val = d->sleep_mult;
+            m_log("Using %.3lf sleep multiplier for ddc display %s.\n", d->sleep_mult, d->id);
+            store_sleep_mults();
+        }
+    }
+    return op->rc != 0;
+}
+
+static int submit_ddc_op(ddc_op_type type, const char *id, const uint16_t val, void (*cb)(ddc_op *op), void *ctx) {
+    ddc_op *op = calloc(1, sizeof(ddc_op));
+    if (!op) {
+        return -ENOMEM;
+    }
+    op->type = type;
+    strncpy(op->id, id, sizeof(op->id) - 1);
+    ddc_display *d = get_ddc_display(op->id);
+    op->dref = d ? d->dref : NULL;
+    op->sleep_mult = d ? d->sleep_mult : 1.0;
+    op->verify = d && type == DDC_WRITE && (!d->tuned || ++d->writes % DDC_SAMPLE_WRITES == 0);
+    op->val = val;
+    op->cb = cb;
+    op->ctx = ctx;
+    
+    int r = worker_pool_submit(ddc_pool, op->id, ddc_op_work, on_ddc_op_done, on_ddc_op_cancel, op);
+    if (r < 0) {
+        free(op);
+    }
+    return r;
+}
+
+/* Following functions are run by ddc workers */
+
+static ddc_handle *get_ddc_handle(const char *id) {
+    pthread_mutex_lock(&handles_mtx);
+    ddc_handle *h = map_get(ddc_handles, id);
+    pthread_mutex_unlock(&handles_mtx);
+    return h;
+}
+
+static DDCA_Status hold_ddc_handle(ddc_op *op, ddc_handle **h) {
+    *h = get_ddc_handle(op->id);
+    if (!*h) {
+        DDCA_Display_Ref dref = op->dref;
+        DDCA_Display_Handle dh = NULL;
+        DDCA_Status rc = 0;
+        if (!dref) {
+            rc = resolve_display_ref(op->id, &dref);
+        }
+        if (!rc) {
+            rc = ddca_open_display2(dref, false, &dh);
+        }
+        if (rc) {
+            return rc;
+        }
+        
+        *h = calloc(1, sizeof(ddc_handle));
+        if (!*h) {
+            ddca_close_display(dh);
+            return -ENOMEM;
+        }
+        (*h)->dh = dh;
+        pthread_mutex_lock(&handles_mtx);
+        map_put(ddc_handles, op->id, *h);
+        pthread_mutex_unlock(&handles_mtx);
+    }
+    (*h)->holders++;
+    return 0;
+}
+
+static void release_ddc_handle(const char *id) {
+    ddc_handle *h = get_ddc_handle(id);
+    if (h && --h->holders == 0) {
+        ddca_close_display(h->dh);
+        pthread_mutex_lock(&handles_mtx);
+        map_remove(ddc_handles, id);
+        pthread_mutex_unlock(&handles_mtx);
+    }
+}
+
+static void ddc_op_work(void *data) {
+    ddc_op *op = (ddc_op *)data;
+    ddc_handle *h = NULL;
+    
+    pthread_rwlock_rdlock(&ddc_lock);
+    /* Both are per-thread settings, and a worker serves many displays */
+    ddca_set_sleep_multiplier(op->sleep_mult);
+    ddca_enable_verify(op->verify);
+    switch (op->type) {
+        case DDC_HOLD:
+        case DDC_READ:
+            op->rc = hold_ddc_handle(op, &h);
+            if (!op->rc) {
+                DDCA_Any_Vcp_Value *valrec;
+                const uint64_t start = stats_now();
+                op->rc = ddca_get_any_vcp_value_using_explicit_type(h->dh, br_code, DDCA_NON_TABLE_VCP_VALUE, &valrec);
+                const uint64_t us = stats_record_op(STATS_DDC_READ, start, op->rc != 0);
+                USDT(ddc__read, op->id, op->rc, us);
+                if (!op->rc) {
+                    op->val = VALREC_CUR_VAL(valrec);
+                    op->max = VALREC_MAX_VAL(valrec);
+                    ddca_free_any_vcp_value(valrec);
+                }
+                /* Reads only hold the display for their own duration */
+                if (op->type == DDC_READ || op->rc) {
+                    release_ddc_handle(op->id);
+                }
+            }
+            break;
+        case DDC_WRITE:
+            h = get_ddc_handle(op->id);
+            if (h) {
+                const uint64_t start = stats_now();
+                op->rc = ddca_set_non_table_vcp_value(h->dh, br_code, op->val >> 8, op->val & 0xff);
+                op->write_ms = (stats_now() - start) / 1000;
+                const uint64_t us = stats_record_op(STATS_DDC_WRITE, start, op->rc != 0);
+                USDT(ddc__write, op->id, op->val, op->rc, us);
+            } else {
+                op->rc = -ENODEV;
+            }
+            break;
+        case DDC_RELEASE:
+            release_ddc_handle(op->id);
+            break;
+        default:
+            break;
+    }
+    pthread_rwlock_unlock(&ddc_lock);
+}
+
+/* Following functions are run from main loop, once an op completed */
+
+static void on_ddc_op_done(void *data) {
+    ddc_op *op = (ddc_op *)data;
+    if (op->cb) {
+        op->cb(op);
+    }
+    free(op);
+}
+
+/* Pool is being destroyed while op is pending: only release its client, or its request */
+static void on_ddc_op_cancel(void *data) {
+    ddc_op *op = (ddc_op *)data;
+    if (op->cb == on_ddc_step_done) {
+        smooth_client *sc = (smooth_client *)op->ctx;
+        sc->in_flight = false;
+    } else if (op->cb == on_ddc_get_done) {
+        get_request *req = (get_request *)op->ctx;
+        req->pending--;
+        complete_get_request(req);
+    }
+    free(op);
+}
+
+static void on_ddc_step_done(ddc_op *op) {
+    smooth_client *sc = (smooth_client *)op->ctx;
+    sc->in_flight = false;
+    const bool retry = op->type == DDC_WRITE && tune_sleep_mult(op);
+    
+    /* 
+     * There is no change notification for ddc displays:
+     * their shadow is refreshed by the read issued when a transition holds them.
+     */
+    backlight_dev *dev = get_backlight_dev(sc->d.sn);
+    if (!op->rc) {
+        if (op->type == DDC_HOLD) {
+            sc->held = true;
+        }
+        if (dev) {
+            dev->external = true;
+            update_backlight_dev(dev, op->val, op->type == DDC_HOLD ? op->max : 0);
+            if (op->type == DDC_WRITE) {
+                update_write_latency(dev, op->write_ms);
+            }
+        }
+    } else if (dev) {
+        dev->curr = -1;
+    }
+    
+    if (sc->orphan) {
+        /* Client was removed from running_clients while op was in flight */
+        for (int i = 0; i < num_orphans; i++) {
+            if (orphans[i] == sc) {
+                orphans[i] = orphans[--num_orphans];
+                break;
+            }
+        }
+        dtor_client(sc);
+        return;
+    }
+    
+    if (retry && submit_ddc_op(DDC_WRITE, sc->d.sn, op->val, on_ddc_step_done, sc) >= 0) {
+        /* Sleep multiplier was raised: retry same write */
+        sc->in_flight = true;
+        return;
+    }
+    
+    int ret = op->rc ? -1 : 0;
+    if (!ret && op->type == DDC_HOLD) {
+        /* Display is now held: proceed with first write */
+        ret = set_external_backlight(sc);
+    }
+    if (ret <= 0) {
+        end_smooth_step(sc, ret);
+    }
+}
+
+static void on_ddc_get_done(ddc_op *op) {
+    get_request *req = (get_request *)op->ctx;
+    if (!op->rc) {
+        append_backlight(req->reply, op->id, (double)op->val / op->max);
+        req->found++;
+        
+        backlight_dev *dev = get_backlight_dev(op->id);
+        if (dev) {
+            dev->external = true;
+            update_backlight_dev(dev, op->val, op->max);
+        }
+    }
+    req->pending--;
+    complete_get_request(req);
+}
+
+#endif
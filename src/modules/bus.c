@@ -1,7 +1,11 @@
 #include <commons.h>
+#include <polkit.h>
+#include <stats.h>
 
 static int get_version( sd_bus *b, const char *path, const char *interface, const char *property,
                         sd_bus_message *reply, void *userdata, sd_bus_error *error);
+static int method_get_stats(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int method_reset_stats(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 
 static const char object_path[] = "/org/clightd/clightd";
 static const char bus_interface[] = "org.clightd.clightd";
@@ -10,6 +14,18 @@ static const sd_bus_vtable vtable[] = {
     SD_BUS_PROPERTY("Version", "s", get_version, 0, SD_BUS_VTABLE_PROPERTY_CONST),
     SD_BUS_VTABLE_END
 };
+/* 
+ * Stats of every bus method (from call receipt until it is replied, even when deferred to a worker or polkit)
+ * and of underlying operations.
+ * Each entry is: name, count, errors, total us, max us, log2 latency histogram (see stats.h).
+ */
+static const char stats_interface[] = "org.clightd.clightd.Stats";
+static const sd_bus_vtable stats_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("Get", NULL, "a(sttttat)a(sttttat)", method_get_stats, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("Reset", NULL, "b", method_reset_stats, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_VTABLE_END
+};
 
 MODULE("BUS");
 
@@ -32,6 +48,14 @@ static void init(void) {
                                  bus_interface,
                                  vtable,
                                  NULL);
+    if (r >= 0) {
+        r = stats_add_object_vtable(bus,
+                                    NULL,
+                                    object_path,
+                                    stats_interface,
+                                    stats_vtable,
+                                    NULL);
+    }
     if (r < 0) {
         m_log("Failed to issue method call: %s\n", strerror(-r));
     } else {
@@ -62,3 +86,27 @@ static int get_version( sd_bus *b, const char *path, const char *interface, cons
                         sd_bus_message *reply, void *userdata, sd_bus_error *error) {
     return sd_bus_message_append(reply, "s", VERSION);
 }
+
+static int method_get_stats(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    sd_bus_message *reply = NULL;
+    int r = sd_bus_message_new_method_return(m, &reply);
+    if (r >= 0) {
+        r = stats_append_methods(reply);
+    }
+    if (r >= 0) {
+        r = stats_append_ops(reply);
+    }
+    if (r >= 0) {
+        r = sd_bus_send(NULL, reply, NULL);
+    }
+    sd_bus_message_unref(reply);
+    return r;
+}
+
+static int method_reset_stats(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    ASSERT_AUTH(m, method_reset_stats, userdata, ret_error);
+    
+    stats_reset();
+    m_log("Stats reset.\n");
+    return sd_bus_reply_method_return(m, "b", true);
+}
@@ -2,11 +2,32 @@
 
 #include <commons.h>
 #include <polkit.h>
+#include <stats.h>
+#include <coalesce.h>
+#include <worker.h>
+#include <lazy.h>
 #include "dpms_plugins/xorg.h"
 #include "dpms_plugins/tty.h"
 
+/* A dpms get (level < 0) or set, run on dpms worker */
+typedef struct {
+    sd_bus_message *m;          // method call to be replied
+    char *display;
+    char *xauthority;
+    int level;
+    int r;                      // resulting state, or error
+} dpms_job;
+
+static void start(void);
 static int method_getdpms(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 static int method_setdpms(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int submit_dpms_job(sd_bus_message *m, const char *display, const char *xauthority, const int level);
+static void dpms_work(void *data);
+static void on_dpms_done(void *data);
+static void on_dpms_cancel(void *data);
+static void free_dpms_job(dpms_job *job);
+
+static worker_pool_t *dpms_pool;
 
 static const char object_path[] = "/org/clightd/clightd/Dpms";
 static const char bus_interface[] = "org.clightd.clightd.Dpms";
@@ -32,22 +53,37 @@ static bool evaluate(void) {
 }
 
 static void init(void) {
-    int r = sd_bus_add_object_vtable(bus,
-                                     NULL,
-                                     object_path,
-                                     bus_interface,
-                                     vtable,
-                                     NULL);
+    int r = stats_add_object_vtable(bus,
+                                    NULL,
+                                    object_path,
+                                    bus_interface,
+                                    vtable,
+                                    NULL);
     if (r < 0) {
         m_log("Failed to issue method call: %s\n", strerror(-r));
     }
+    if (r >= 0) {
+        lazy_register(object_path, start);
+    }
 }
 
-static void receive(const msg_t *msg, const void *userdata) {
+/* Called on first method call on Dpms object */
+static void start(void) {
+    /* X and tty calls are run by a worker, not to block main loop */
+    dpms_pool = worker_pool_new(1);
+    if (dpms_pool) {
+        m_register_fd(worker_pool_get_fd(dpms_pool), false, NULL);
+    }
+}
 
+static void receive(const msg_t *msg, const void *userdata) {
+    if (!msg->is_pubsub) {
+        worker_pool_dispatch(dpms_pool);
+    }
 }
 
 static void destroy(void) {
+    worker_pool_free(dpms_pool);
     xorg_close();
     tty_close();
 }
@@ -62,19 +98,13 @@ static int method_getdpms(sd_bus_message *m, void *userdata, sd_bus_error *ret_e
         return r;
     }
     
-    int dpms_state = 0;
-    if (display && strlen(display)) {
-        dpms_state = xorg_get_dpms_state(display, xauthority);
-    } else {
-        dpms_state = tty_get_dpms_state(); 
-    }
-    if (dpms_state < 0) {
-        sd_bus_error_set_const(ret_error, SD_BUS_ERROR_FAILED, "Failed to set dpms.");
-        return dpms_state;
+    /* Identical calls received meanwhile are replied together with this one */
+    COALESCE(m);
+    r = submit_dpms_job(m, display, xauthority, -1);
+    if (r < 0) {
+        coalesce_send_errno(m, -r);
     }
-    
-    m_log("Current dpms state: %d.\n", dpms_state);
-    return sd_bus_reply_method_return(m, "i", dpms_state);
+    return 1;
 }
 
 static int method_setdpms(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
@@ -82,10 +112,7 @@ static int method_setdpms(sd_bus_message *m, void *userdata, sd_bus_error *ret_e
     int level;
     
     /* Require polkit auth */
-    if (!check_authorization(m)) {
-        sd_bus_error_set_errno(ret_error, EPERM);
-        return -EPERM;
-    }
+    ASSERT_AUTH(m, method_setdpms, userdata, ret_error);
     
     /* Read the parameters */
     int r = sd_bus_message_read(m, "ssi", &display, &xauthority, &level);
@@ -100,21 +127,77 @@ static int method_setdpms(sd_bus_message *m, void *userdata, sd_bus_error *ret_e
         return -EINVAL;
     }
     
-    int err = 0;
-    if (display && strlen(display)) {
-        /* Xorg */
-        err = xorg_set_dpms_state(display, xauthority, level);
+    r = submit_dpms_job(m, display, xauthority, level);
+    if (r < 0) {
+        sd_bus_error_set_errno(ret_error, -r);
+    }
+    return r;
+}
+
+/* Method call is replied by on_dpms_done() */
+static int submit_dpms_job(sd_bus_message *m, const char *display, const char *xauthority, const int level) {
+    dpms_job *job = calloc(1, sizeof(dpms_job));
+    if (!job) {
+        return -ENOMEM;
+    }
+    job->m = sd_bus_message_ref(m);
+    stats_defer(m);
+    job->display = strdup(display ? display : "");
+    job->xauthority = strdup(xauthority ? xauthority : "");
+    job->level = level;
+    if (worker_pool_submit(dpms_pool, "dpms", dpms_work, on_dpms_done, on_dpms_cancel, job) < 0) {
+        /* No worker: run it right away */
+        dpms_work(job);
+        on_dpms_done(job);
+    }
+    return 1;
+}
+
+static void dpms_work(void *data) {
+    dpms_job *job = (dpms_job *)data;
+    const bool xorg = strlen(job->display) > 0;
+    const uint64_t start = stats_now();
+    if (job->level < 0) {
+        job->r = xorg ? xorg_get_dpms_state(job->display, job->xauthority) : tty_get_dpms_state();
     } else {
-        /* tty */
-        err = tty_set_dpms_state(level);
+        int err = xorg ? xorg_set_dpms_state(job->display, job->xauthority, job->level) : tty_set_dpms_state(job->level);
+        job->r = err ? err : job->level;
     }
-    if (err) {
-        sd_bus_error_set_const(ret_error, SD_BUS_ERROR_FAILED, "Failed to set dpms level.");
-        return err;
+    if (xorg) {
+        stats_record_op(STATS_X_CALL, start, job->r < 0);
     }
-    
-    m_log("New dpms state: %d.\n", level);
-    return sd_bus_reply_method_return(m, "i", level);
+}
+
+static void on_dpms_done(void *data) {
+    dpms_job *job = (dpms_job *)data;
+    if (job->r < 0) {
+        sd_bus_error error = SD_BUS_ERROR_NULL;
+        sd_bus_error_set_const(&error, SD_BUS_ERROR_FAILED, job->level < 0 ? "Failed to get dpms." : "Failed to set dpms level.");
+        coalesce_send_error(job->m, &error);
+        sd_bus_error_free(&error);
+    } else {
+        m_log("%s dpms state: %d.\n", job->level < 0 ? "Current" : "New", job->r);
+        sd_bus_message *reply = NULL;
+        sd_bus_message_new_method_return(job->m, &reply);
+        sd_bus_message_append(reply, "i", job->r);
+        coalesce_send(job->m, reply);
+        sd_bus_message_unref(reply);
+    }
+    free_dpms_job(job);
+}
+
+/* Module is being destroyed while job is pending */
+static void on_dpms_cancel(void *data) {
+    dpms_job *job = (dpms_job *)data;
+    coalesce_send_errno(job->m, ECANCELED);
+    free_dpms_job(job);
+}
+
+static void free_dpms_job(dpms_job *job) {
+    sd_bus_message_unref(job->m);
+    free(job->display);
+    free(job->xauthority);
+    free(job);
 }
 
 #endif
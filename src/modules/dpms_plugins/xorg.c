@@ -1,7 +1,6 @@
 #ifdef DPMS_PRESENT
 
-#include <commons.h>
-#include <X11/Xlib.h>
+#include <x11.h>
 #include <X11/extensions/dpms.h>
 
 /*
@@ -20,10 +19,7 @@ int xorg_get_dpms_state(const char *display, const char *xauthority) {
     CARD16 s;
     int ret = -1;
     
-    /* set xauthority cookie */
-    setenv("XAUTHORITY", xauthority, 1);
-    
-    Display *dpy = XOpenDisplay(display);
+    Display *dpy = x11_open_display(display, xauthority);
     if (dpy) {
         if (DPMSCapable(dpy)) {
             DPMSInfo(dpy, &s, &onoff);
@@ -31,19 +27,13 @@ int xorg_get_dpms_state(const char *display, const char *xauthority) {
         }
         XCloseDisplay(dpy);
     }
-    
-    /* Drop xauthority cookie */
-    unsetenv("XAUTHORITY");
     return ret;
 }
 
 int xorg_set_dpms_state(const char *display, const char *xauthority, int dpms_level) {
     int ret = -1;
     
-    /* set xauthority cookie */
-    setenv("XAUTHORITY", xauthority, 1);
-    
-    Display *dpy = XOpenDisplay(display);
+    Display *dpy = x11_open_display(display, xauthority);
     if (dpy) {
         if (DPMSCapable(dpy)) {
             DPMSEnable(dpy);
@@ -53,9 +43,6 @@ int xorg_set_dpms_state(const char *display, const char *xauthority, int dpms_le
         }
         XCloseDisplay(dpy);
     }
-    
-    /* Drop xauthority cookie */
-    unsetenv("XAUTHORITY");
     return ret;
 }
 
@@ -5,8 +5,13 @@
 
 #ifdef GAMMA_PRESENT
 
-#include <commons.h>
+#include <x11.h>
 #include <polkit.h>
+#include <stats.h>
+#include <usdt.h>
+#include <coalesce.h>
+#include <worker.h>
+#include <lazy.h>
 #include <X11/extensions/Xrandr.h>
 #include <math.h>
 
@@ -19,6 +24,8 @@ static unsigned short get_blue(int temp);
 static int get_temp(const unsigned short R, const unsigned short B);
 static int set_gamma(int temp, Display *dpy);
 static int get_gamma(Display *dpy);
+static void on_smooth_step(deadline_t *d);
+static void start(void);
 
 typedef struct {
     unsigned int target_temp;
@@ -29,8 +36,34 @@ typedef struct {
     Display *dpy;
 } smooth_change;
 
+typedef enum { GAMMA_OPEN, GAMMA_STEP, GAMMA_CLOSE, GAMMA_GET } gamma_job_type;
+
+/* 
+ * An X job, run on gamma worker.
+ * There is a single worker: jobs are serialized, thus they can share transition display.
+ */
+typedef struct {
+    gamma_job_type type;
+    sd_bus_message *m;          // method call to be replied, if any
+    char *display;
+    char *xauthority;
+    Display *dpy;
+    int temp;                   // temp to be set, or current one
+    smooth_change sc;           // GAMMA_OPEN: requested transition
+} gamma_job;
+
+static void submit_gamma_job(gamma_job_type type, sd_bus_message *m, Display *dpy, const int temp);
+static void gamma_work(void *data);
+static void on_gamma_done(void *data);
+static void on_gamma_cancel(void *data);
+static void free_gamma_job(gamma_job *job);
+static void on_gamma_opened(gamma_job *job);
+static void on_gamma_stepped(gamma_job *job);
+static void on_gamma_got(gamma_job *job);
+
 static smooth_change sc;
-static int smooth_fd;
+static deadline_t smooth_timer;
+static worker_pool_t *gamma_pool;
 static const char object_path[] = "/org/clightd/clightd/Gamma";
 static const char bus_interface[] = "org.clightd.clightd.Gamma";
 static const sd_bus_vtable vtable[] = {
@@ -55,58 +88,61 @@ static bool evaluate(void) {
 }
 
 static void init(void) {
-    int r = sd_bus_add_object_vtable(bus,
-                                     NULL,
-                                     object_path,
-                                     bus_interface,
-                                     vtable,
-                                     NULL);
+    int r = stats_add_object_vtable(bus,
+                                    NULL,
+                                    object_path,
+                                    bus_interface,
+                                    vtable,
+                                    NULL);
     if (r < 0) {
         m_log("Failed to issue method call: %s\n", strerror(-r));
     } else {
-        smooth_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
-        m_register_fd(smooth_fd, true, NULL);
+        deadline_init(&smooth_timer, on_smooth_step, NULL);
+        lazy_register(object_path, start);
+    }
+}
+
+/* Called on first method call on Gamma object */
+static void start(void) {
+    /* X round trips are run by a worker, not to block main loop */
+    gamma_pool = worker_pool_new(1);
+    if (gamma_pool) {
+        m_register_fd(worker_pool_get_fd(gamma_pool), false, NULL);
     }
 }
 
 static void receive(const msg_t *msg, const void *userdata) {
-    if (!msg || !msg->is_pubsub) {
-        uint64_t t;
-        // nonblocking mode!
-        read(smooth_fd, &t, sizeof(uint64_t));
-    
-        if (sc.is_smooth) {
-            if (sc.target_temp < sc.current_temp) {
-                sc.current_temp = sc.current_temp - sc.smooth_step < sc.target_temp ? 
-                sc.target_temp :
-                sc.current_temp - sc.smooth_step;
-            } else {
-                sc.current_temp = sc.current_temp + sc.smooth_step > sc.target_temp ? 
-                sc.target_temp :
-                sc.current_temp + sc.smooth_step;
-            }
-        } else {
-            sc.current_temp = sc.target_temp;
-        }
-    
-        struct itimerspec timerValue = {{0}};
-        if (set_gamma(sc.current_temp, sc.dpy) == sc.target_temp) {
-            XCloseDisplay(sc.dpy);
-            unsetenv("XAUTHORITY");
-            m_log("Reached target temp: %d.\n", sc.target_temp);
-        } else {
-            timerValue.it_value.tv_sec = sc.smooth_wait / 1000; // in ms
-            timerValue.it_value.tv_nsec = 1000 * 1000 * (sc.smooth_wait % 1000); // ms
-        }
-        int ret = timerfd_settime(smooth_fd, 0, &timerValue, NULL);
-        if (userdata) {
-            *(int *)userdata = ret;
-        }
+    if (!msg->is_pubsub) {
+        worker_pool_dispatch(gamma_pool);
     }
 }
 
 static void destroy(void) {
-    
+    deadline_cancel(&smooth_timer);
+    worker_pool_free(gamma_pool);
+    if (sc.dpy) {
+        XCloseDisplay(sc.dpy);
+        sc.dpy = NULL;
+    }
+}
+
+static void on_smooth_step(deadline_t *d) {
+    if (sc.is_smooth) {
+        if (sc.target_temp < sc.current_temp) {
+            sc.current_temp = sc.current_temp - sc.smooth_step < sc.target_temp ? 
+            sc.target_temp :
+            sc.current_temp - sc.smooth_step;
+        } else {
+            sc.current_temp = sc.current_temp + sc.smooth_step > sc.target_temp ? 
+            sc.target_temp :
+            sc.current_temp + sc.smooth_step;
+        }
+    } else {
+        sc.current_temp = sc.target_temp;
+    }
+    USDT(gamma__step, sc.current_temp, sc.target_temp);
+    /* Next step is scheduled once this one is done */
+    submit_gamma_job(GAMMA_STEP, NULL, sc.dpy, sc.current_temp);
 }
 
 static int method_setgamma(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
@@ -115,10 +151,7 @@ static int method_setgamma(sd_bus_message *m, void *userdata, sd_bus_error *ret_
     const int is_smooth;
     const unsigned int smooth_step, smooth_wait;
     
-    if (!check_authorization(m)) {
-        sd_bus_error_set_errno(ret_error, EPERM);
-        return -EPERM;
-    }
+    ASSERT_AUTH(m, method_setgamma, userdata, ret_error);
     
     /* Read the parameters */
     int r = sd_bus_message_read(m, "ssi(buu)", &display, &xauthority, &temp, 
@@ -130,41 +163,34 @@ static int method_setgamma(sd_bus_message *m, void *userdata, sd_bus_error *ret_
 
     if (temp < 1000 || temp > 10000) {
         error = EINVAL;
-    } else {
-        /* set xauthority cookie */
-        setenv("XAUTHORITY", xauthority, 1);
-        
-        Display *dpy = XOpenDisplay(display);
-        if (dpy == NULL) {
-            m_log("XopenDisplay");
-            error = ENXIO;
-            /* Drop xauthority cookie */
-            unsetenv("XAUTHORITY");
-        } else {
-            sc.target_temp = temp;
-            sc.smooth_step = smooth_step;
-            sc.smooth_wait = smooth_wait;
-            sc.is_smooth = is_smooth;
-            sc.dpy = dpy;
-            sc.current_temp = get_gamma(sc.dpy);
-            m_log("Temperature target value set (smooth %d): %d.\n", is_smooth, temp);
-            receive(NULL, &error); // xauthority cookie will be dropped here when smooth transition is finished
-        }
-    }
-    if (error) {
-        if (error == EINVAL) {
-            sd_bus_error_set_const(ret_error, SD_BUS_ERROR_FAILED, "Temperature value should be between 1000 and 10000.");
-        } else if (error == ENXIO) {
-            sd_bus_error_set_const(ret_error, SD_BUS_ERROR_FAILED, "Could not open X screen.");
-        }
+        sd_bus_error_set_const(ret_error, SD_BUS_ERROR_FAILED, "Temperature value should be between 1000 and 10000.");
         return -error;
     }
     
-    return sd_bus_reply_method_return(m, "b", !error);
+    /* Transition is started (and method call replied) by on_gamma_opened() */
+    gamma_job *job = calloc(1, sizeof(gamma_job));
+    if (!job) {
+        sd_bus_error_set_errno(ret_error, ENOMEM);
+        return -ENOMEM;
+    }
+    job->type = GAMMA_OPEN;
+    job->m = sd_bus_message_ref(m);
+    stats_defer(m);
+    job->display = strdup(display);
+    job->xauthority = strdup(xauthority);
+    job->sc.target_temp = temp;
+    job->sc.smooth_step = smooth_step;
+    job->sc.smooth_wait = smooth_wait;
+    job->sc.is_smooth = is_smooth;
+    if (worker_pool_submit(gamma_pool, "gamma", gamma_work, on_gamma_done, on_gamma_cancel, job) < 0) {
+        /* No worker: run it right away */
+        gamma_work(job);
+        on_gamma_done(job);
+    }
+    return 1;
 }
 
 static int method_getgamma(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-    int error = 0, temp;
     const char *display = NULL, *xauthority = NULL;
     
     /* Read the parameters */
@@ -174,32 +200,182 @@ static int method_getgamma(sd_bus_message *m, void *userdata, sd_bus_error *ret_
         return r;
     }
     
-    /* set xauthority cookie */
-    setenv("XAUTHORITY", xauthority, 1);
-    
-    Display *dpy = XOpenDisplay(display);
-    if (dpy == NULL) {
+    /* Method call is replied by on_gamma_got(), together with any identical one received meanwhile */
+    COALESCE(m);
+    gamma_job *job = calloc(1, sizeof(gamma_job));
+    if (!job) {
+        coalesce_send_errno(m, ENOMEM);
+        return 1;
+    }
+    job->type = GAMMA_GET;
+    job->m = sd_bus_message_ref(m);
+    job->display = strdup(display);
+    job->xauthority = strdup(xauthority);
+    if (worker_pool_submit(gamma_pool, "gamma", gamma_work, on_gamma_done, on_gamma_cancel, job) < 0) {
+        gamma_work(job);
+        on_gamma_done(job);
+    }
+    return 1;
+}
+
+static void submit_gamma_job(gamma_job_type type, sd_bus_message *m, Display *dpy, const int temp) {
+    gamma_job *job = calloc(1, sizeof(gamma_job));
+    if (job) {
+        job->type = type;
+        job->m = m ? sd_bus_message_ref(m) : NULL;
+        job->dpy = dpy;
+        job->temp = temp;
+        if (worker_pool_submit(gamma_pool, "gamma", gamma_work, on_gamma_done, on_gamma_cancel, job) < 0) {
+            gamma_work(job);
+            on_gamma_done(job);
+        }
+    }
+}
+
+static void gamma_work(void *data) {
+    gamma_job *job = (gamma_job *)data;
+    const uint64_t start = stats_now();
+    switch (job->type) {
+        case GAMMA_OPEN:
+            job->dpy = x11_open_display(job->display, job->xauthority);
+            if (job->dpy) {
+                job->temp = get_gamma(job->dpy);
+            }
+            break;
+        case GAMMA_STEP:
+            set_gamma(job->temp, job->dpy);
+            break;
+        case GAMMA_CLOSE:
+            XCloseDisplay(job->dpy);
+            job->dpy = NULL;
+            break;
+        case GAMMA_GET:
+            job->temp = -1;
+            job->dpy = x11_open_display(job->display, job->xauthority);
+            if (job->dpy) {
+                job->temp = get_gamma(job->dpy);
+                XCloseDisplay(job->dpy);
+            }
+            break;
+        default:
+            break;
+    }
+    stats_record_op(STATS_X_CALL, start, job->type != GAMMA_CLOSE && !job->dpy);
+}
+
+/* Following functions are run from main loop, once a job completed */
+
+static void on_gamma_done(void *data) {
+    gamma_job *job = (gamma_job *)data;
+    switch (job->type) {
+        case GAMMA_OPEN:
+            on_gamma_opened(job);
+            break;
+        case GAMMA_STEP:
+            on_gamma_stepped(job);
+            break;
+        case GAMMA_GET:
+            on_gamma_got(job);
+            break;
+        default:
+            break;
+    }
+    free_gamma_job(job);
+}
+
+/* Module is being destroyed while job is pending: release any display it owns */
+static void on_gamma_cancel(void *data) {
+    gamma_job *job = (gamma_job *)data;
+    switch (job->type) {
+        case GAMMA_OPEN:
+            if (job->dpy) {
+                XCloseDisplay(job->dpy);
+            }
+            sd_bus_reply_method_errno(job->m, ECANCELED, NULL);
+            stats_reply(job->m, true);
+            break;
+        case GAMMA_CLOSE:
+            if (job->dpy) {
+                XCloseDisplay(job->dpy);
+            }
+            break;
+        case GAMMA_GET:
+            coalesce_send_errno(job->m, ECANCELED);
+            break;
+        default:
+            break;
+    }
+    free_gamma_job(job);
+}
+
+static void free_gamma_job(gamma_job *job) {
+    if (job->m) {
+        sd_bus_message_unref(job->m);
+    }
+    free(job->display);
+    free(job->xauthority);
+    free(job);
+}
+
+static void on_gamma_opened(gamma_job *job) {
+    if (!job->dpy) {
         m_log("XopenDisplay");
-        error = ENXIO;
-    } else {
-        temp = get_gamma(dpy);
-        XCloseDisplay(dpy);
+        sd_bus_error error = SD_BUS_ERROR_NULL;
+        sd_bus_error_set_const(&error, SD_BUS_ERROR_FAILED, "Could not open X screen.");
+        sd_bus_reply_method_error(job->m, &error);
+        stats_reply(job->m, true);
+        sd_bus_error_free(&error);
+        return;
     }
     
-    /* Drop xauthority cookie */
-    unsetenv("XAUTHORITY");
+    /* Replace any running transition; its display is closed after its in-flight step, if any */
+    deadline_cancel(&smooth_timer);
+    if (sc.dpy) {
+        submit_gamma_job(GAMMA_CLOSE, NULL, sc.dpy, 0);
+    }
+    sc = job->sc;
+    sc.dpy = job->dpy;
+    sc.current_temp = job->temp;
+    m_log("Temperature target value set (smooth %d): %d.\n", sc.is_smooth, sc.target_temp);
+    sd_bus_reply_method_return(job->m, "b", true);
+    stats_reply(job->m, false);
+    on_smooth_step(&smooth_timer);
+}
+
+static void on_gamma_stepped(gamma_job *job) {
+    if (job->dpy != sc.dpy) {
+        /* Step of a replaced transition */
+        return;
+    }
     
-    if (error) {
-        if (error == ENXIO) {
-            sd_bus_error_set_const(ret_error, SD_BUS_ERROR_FAILED, "Could not open X screen.");
+    if (sc.current_temp == sc.target_temp) {
+        submit_gamma_job(GAMMA_CLOSE, NULL, sc.dpy, 0);
+        sc.dpy = NULL;
+        m_log("Reached target temp: %d.\n", sc.target_temp);
+    } else {
+        deadline_set(&smooth_timer, sc.smooth_wait);
+    }
+}
+
+static void on_gamma_got(gamma_job *job) {
+    if (job->temp < 0) {
+        sd_bus_error error = SD_BUS_ERROR_NULL;
+        if (!job->dpy) {
+            m_log("XopenDisplay");
+            sd_bus_error_set_const(&error, SD_BUS_ERROR_FAILED, "Could not open X screen.");
         } else {
-            sd_bus_error_set_const(ret_error, SD_BUS_ERROR_FAILED, "Failed to get screen temperature.");
+            sd_bus_error_set_const(&error, SD_BUS_ERROR_FAILED, "Failed to get screen temperature.");
         }
-        return -error;
+        coalesce_send_error(job->m, &error);
+        sd_bus_error_free(&error);
+        return;
     }
-    
-    m_log("Current gamma value: %d.\n", temp);
-    return sd_bus_reply_method_return(m, "i", temp);
+    m_log("Current gamma value: %d.\n", job->temp);
+    sd_bus_message *reply = NULL;
+    sd_bus_message_new_method_return(job->m, &reply);
+    sd_bus_message_append(reply, "i", job->temp);
+    coalesce_send(job->m, reply);
+    sd_bus_message_unref(reply);
 }
 
 static unsigned short clamp(double x, double max) {
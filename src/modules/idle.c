@@ -3,6 +3,8 @@
 #include <module/map.h>
 #include <linux/limits.h>
 #include <math.h>
+#include <stats.h>
+#include <usdt.h>
 #include <stddef.h>
 
 #define BUF_LEN (sizeof(struct inotify_event) + NAME_MAX + 1)
@@ -13,13 +15,14 @@ typedef struct {
     bool running;               // Whether "Start" method has been called on Client
     unsigned int timeout;
     unsigned int id;            // Client's id
-    int fd;                     // Client's timer fd
+    deadline_t timer;           // Client's timer
     char *sender;               // BusName who requested this client
     char path[PATH_MAX + 1];    // Client's object path
     sd_bus_slot *slot;          // vtable's slot
 } idle_client_t;
 
 static void dtor_client(void *client);
+static void on_client_timeout(deadline_t *d);
 static map_ret_code leave_idle(void *userdata, const char *key, void *client);
 static map_ret_code find_free_client(void *out, const char *key, void *client);
 static idle_client_t *find_available_client(void);
@@ -72,12 +75,12 @@ static bool evaluate(void) {
 
 static void init(void) {
     clients = map_new(true, dtor_client);
-    int r = sd_bus_add_object_vtable(bus,
-                                     NULL,
-                                     object_path,
-                                     bus_interface,
-                                     vtable,
-                                     NULL);
+    int r = stats_add_object_vtable(bus,
+                                    NULL,
+                                    object_path,
+                                    bus_interface,
+                                    vtable,
+                                    NULL);
     if (r < 0) {
         m_log("Failed to issue method call: %s\n", strerror(-r));
     }
@@ -100,28 +103,24 @@ static void receive(const msg_t *msg, const void *userdata) {
                     map_iterate(clients, leave_idle, NULL);
                 }
             }
-        } else {
-            idle_client_t *c = (idle_client_t *)msg->fd_msg->userptr;
-            if (c) {
-                uint64_t t;
-                read(msg->fd_msg->fd, &t, sizeof(uint64_t));
-            
-                const time_t idle_t = time(NULL) - last_input;
-                c->is_idle = idle_t >= c->timeout;
-                struct itimerspec timerValue = {{0}};
-                if (c->is_idle) {
-                    idler++;
-                    sd_bus_emit_signal(bus, c->path, clients_interface, "Idle", "b", true);
-                } else {
-                    timerValue.it_value.tv_sec = c->timeout - idle_t;
-                }
-                timerfd_settime(msg->fd_msg->fd, 0, &timerValue, NULL);
-                m_log("Client %d -> Idle: %d\n", c->id, c->is_idle);
-            }
         }
     }
 }
 
+static void on_client_timeout(deadline_t *d) {
+    idle_client_t *c = (idle_client_t *)d->userdata;
+    const time_t idle_t = time(NULL) - last_input;
+    c->is_idle = idle_t >= c->timeout;
+    USDT(idle__timeout, c->id, (long)idle_t, c->is_idle);
+    if (c->is_idle) {
+        idler++;
+        sd_bus_emit_signal(bus, c->path, clients_interface, "Idle", "b", true);
+    } else {
+        deadline_set(d, 1000ULL * (c->timeout - idle_t));
+    }
+    m_log("Client %d -> Idle: %d\n", c->id, c->is_idle);
+}
+
 static void destroy(void) {
     if (running_clients > 0) {
         inotify_rm_watch(inot_fd, inot_wd);
@@ -135,9 +134,7 @@ static map_ret_code leave_idle(void *userdata, const char *key, void *client) {
         sd_bus_emit_signal(bus, c->path, clients_interface, "Idle", "b", false);
         c->is_idle = false;
         idler--;
-        struct itimerspec timerValue = {{0}};
-        timerValue.it_value.tv_sec = c->timeout;
-        timerfd_settime(c->fd, 0, &timerValue, NULL);
+        deadline_set(&c->timer, 1000ULL * c->timeout);
     }
     return MAP_OK;
 }
@@ -176,7 +173,7 @@ static idle_client_t *find_available_client(void) {
 }
 
 static void destroy_client(idle_client_t *c) {
-    m_deregister_fd(c->fd);
+    deadline_cancel(&c->timer);
     free(c->sender);
     c->slot = sd_bus_slot_unref(c->slot);
     m_log("Freeing client %u\n", c->id);
@@ -196,19 +193,18 @@ static int method_get_client(sd_bus_message *m, void *userdata, sd_bus_error *re
     idle_client_t *c = find_available_client();
     if (c) {
         c->in_use = true;
-        c->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
-        m_register_fd(c->fd, true, c);
+        deadline_init(&c->timer, on_client_timeout, c);
         c->sender = strdup(sd_bus_message_get_sender(m));
         snprintf(c->path, sizeof(c->path) - 1, "%s/Client%u", object_path, c->id);
 
         map_put(clients, c->path, c);
         
-        sd_bus_add_object_vtable(bus,
-                                &c->slot,
-                                c->path,
-                                clients_interface,
-                                vtable_clients,
-                                c);
+        stats_add_object_vtable(bus,
+                               &c->slot,
+                               c->path,
+                               clients_interface,
+                               vtable_clients,
+                               c);
         return sd_bus_reply_method_return(m, "o", c->path);
     }
     sd_bus_error_set_errno(ret_error, ENOMEM);
@@ -245,9 +241,7 @@ static int method_start_client(sd_bus_message *m, void *userdata, sd_bus_error *
     if (c) {
         /* You can only start not-started clients, that must have Timeout setted */
         if (c->timeout > 0 && !c->running) {
-            struct itimerspec timerValue = {{0}};
-            timerValue.it_value.tv_sec = c->timeout;
-            timerfd_settime(c->fd, 0, &timerValue, NULL);
+            deadline_set(&c->timer, 1000ULL * c->timeout);
             c->running = true;
             if (++running_clients == 1) {
                 /* Ok, start listening on /dev/input events as first client was started */
@@ -267,10 +261,9 @@ static int method_stop_client(sd_bus_message *m, void *userdata, sd_bus_error *r
     if (c) {
         /* You can only stop running clients */
         if (c->running) {
-            /* Do not reset timerfd is client is in idle state */
+            /* Do not reset timer is client is in idle state */
             if (!c->is_idle) {
-                struct itimerspec timerValue = {{0}};
-                timerfd_settime(c->fd, 0, &timerValue, NULL);
+                deadline_cancel(&c->timer);
             }
             
             if (--running_clients == 0) {
@@ -306,21 +299,16 @@ static int set_timeout(sd_bus *b, const char *path, const char *interface, const
     }
 
     if (c->running && !c->is_idle) {
-        struct itimerspec timerValue = {{0}};
-
         int new_timer = *(int *)userdata;
-        timerfd_gettime(c->fd, &timerValue);
-        int old_elapsed = old_timer - timerValue.it_value.tv_sec;
+        int old_elapsed = old_timer - (int)(deadline_remaining(&c->timer) / 1000);
         int new_timeout = new_timer - old_elapsed;
         if (new_timeout <= 0) {
-            timerValue.it_value.tv_nsec = 1;
-            timerValue.it_value.tv_sec = 0;
+            deadline_set(&c->timer, 0);
             m_log("Starting now.\n");
         } else {
-            timerValue.it_value.tv_sec = new_timeout;
+            deadline_set(&c->timer, 1000ULL * new_timeout);
             m_log("Next timer: %d\n", new_timeout);
         }
-        r = timerfd_settime(c->fd, 0, &timerValue, NULL);
     }
     return r;
 }
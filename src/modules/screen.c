@@ -1,12 +1,31 @@
 #ifdef SCREEN_PRESENT
 
-#include <commons.h>
+#include <x11.h>
+#include <worker.h>
+#include <lazy.h>
+#include <coalesce.h>
+#include <stats.h>
 #include <X11/Xutil.h>
 
 #define MONITOR_ILL_MAX              255
 
+/* A root window brightness computation, run on screen worker */
+typedef struct {
+    sd_bus_message *m;          // method call to be replied
+    char *display;
+    char *xauthority;
+    int br;
+} screen_job;
+
+static void start(void);
 static int method_getbrightness(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
-static int getRootBrightness(const char *screen_name);
+static void screen_work(void *data);
+static void on_screen_done(void *data);
+static void on_screen_cancel(void *data);
+static void free_screen_job(screen_job *job);
+static int getRootBrightness(const char *screen_name, const char *xauthority);
+
+static worker_pool_t *screen_pool;
 
 static const char object_path[] = "/org/clightd/clightd/Screen";
 static const char bus_interface[] = "org.clightd.clightd.Screen";
@@ -31,23 +50,37 @@ static bool evaluate(void) {
 }
 
 static void init(void) {
-    int r = sd_bus_add_object_vtable(bus,
-                                     NULL,
-                                     object_path,
-                                     bus_interface,
-                                     vtable,
-                                     NULL);
+    int r = stats_add_object_vtable(bus,
+                                    NULL,
+                                    object_path,
+                                    bus_interface,
+                                    vtable,
+                                    NULL);
     if (r < 0) {
         m_log("Failed to issue method call: %s\n", strerror(-r));
     }
+    if (r >= 0) {
+        lazy_register(object_path, start);
+    }
 }
 
-static void receive(const msg_t *msg, const void *userdata) {
+/* Called on first method call on Screen object */
+static void start(void) {
+    /* Grabbing root window is slow: it is run by a worker, not to block main loop */
+    screen_pool = worker_pool_new(1);
+    if (screen_pool) {
+        m_register_fd(worker_pool_get_fd(screen_pool), false, NULL);
+    }
+}
 
+static void receive(const msg_t *msg, const void *userdata) {
+    if (!msg->is_pubsub) {
+        worker_pool_dispatch(screen_pool);
+    }
 }
 
 static void destroy(void) {
-    
+    worker_pool_free(screen_pool);
 }
 
 static int method_getbrightness(sd_bus_message* m, void* userdata, sd_bus_error* ret_error) {
@@ -60,25 +93,69 @@ static int method_getbrightness(sd_bus_message* m, void* userdata, sd_bus_error*
         return r;
     }
     
-    setenv("XAUTHORITY", xauthority, 1);
-    const int br = getRootBrightness(display);
-    unsetenv("XAUTHORITY");
+    /* Identical calls received meanwhile are replied together with this one */
+    COALESCE(m);
+    screen_job *job = calloc(1, sizeof(screen_job));
+    if (!job) {
+        coalesce_send_errno(m, ENOMEM);
+        return 1;
+    }
+    job->m = sd_bus_message_ref(m);
+    job->display = strdup(display);
+    job->xauthority = strdup(xauthority);
+    if (worker_pool_submit(screen_pool, "screen", screen_work, on_screen_done, on_screen_cancel, job) < 0) {
+        /* No worker: run it right away */
+        screen_work(job);
+        on_screen_done(job);
+    }
+    return 1;
+}
 
-    switch (br) {
+static void screen_work(void *data) {
+    screen_job *job = (screen_job *)data;
+    const uint64_t start = stats_now();
+    job->br = getRootBrightness(job->display, job->xauthority);
+    stats_record_op(STATS_X_CALL, start, job->br <= 0);
+}
+
+static void on_screen_done(void *data) {
+    screen_job *job = (screen_job *)data;
+    switch (job->br) {
     case -EINVAL:
-        sd_bus_error_set_errno(ret_error, -br);
-        return br;
+        coalesce_send_errno(job->m, -job->br);
+        break;
     case 0:
-        sd_bus_error_set_errno(ret_error, EIO);
-        return -EIO;
-    default:
-        return sd_bus_reply_method_return(m, "d", (double)br / MONITOR_ILL_MAX);
+        coalesce_send_errno(job->m, EIO);
+        break;
+    default: {
+        sd_bus_message *reply = NULL;
+        sd_bus_message_new_method_return(job->m, &reply);
+        sd_bus_message_append(reply, "d", (double)job->br / MONITOR_ILL_MAX);
+        coalesce_send(job->m, reply);
+        sd_bus_message_unref(reply);
+        break;
+    }
     }
+    free_screen_job(job);
+}
+
+/* Module is being destroyed while job is pending */
+static void on_screen_cancel(void *data) {
+    screen_job *job = (screen_job *)data;
+    coalesce_send_errno(job->m, ECANCELED);
+    free_screen_job(job);
+}
+
+static void free_screen_job(screen_job *job) {
+    sd_bus_message_unref(job->m);
+    free(job->display);
+    free(job->xauthority);
+    free(job);
 }
 
 /* Robbed from calise source code, thanks!! */
-static int getRootBrightness(const char *screen_name) {
-    Display *dpy = XOpenDisplay(screen_name);
+static int getRootBrightness(const char *screen_name, const char *xauthority) {
+    Display *dpy = x11_open_display(screen_name, xauthority);
     if (!dpy) {
         return -EINVAL;
     }
@@ -1,16 +1,40 @@
 #include <commons.h>
 #include <sensor.h>
 #include <polkit.h>
+#include <stats.h>
+#include <worker.h>
+#include <lazy.h>
+
+/* A capture, run on sensor worker: device is resolved from main loop, as udev context is not thread safe */
+typedef struct {
+    sensor_t *sensor;
+    char *devnode;
+    char *syspath;
+    double *pct;
+    int num_captures;
+    char *settings;
+    int r;
+    sensor_capture_cb cb;
+    void *userdata;
+} capture_job;
 
 static enum sensors get_sensor_type(const char *str);
 static int is_sensor_available(sensor_t *sensor, const char *interface, 
                                 struct udev_device **device);
 static int sensor_get_monitor(const enum sensors s);
 static void sensor_receive_device(const sensor_t *sensor, struct udev_device **dev);
+static void start(void);
+static sensor_t *find_sensor(enum sensors s, const char *interface, struct udev_device **dev);
+static void capture_work(void *data);
+static void on_capture_done(void *data);
+static void on_capture_cancel(void *data);
+static void on_bus_capture(const int r, const char *devnode, const double *pct, const int num_captures, void *userdata);
 static int method_issensoravailable(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 static int method_capturesensor(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 
 static sensor_t sensors[SENSOR_NUM];
+static worker_pool_t *capture_pool;
+static bool started;
 static const char object_path[] = "/org/clightd/clightd/Sensor";
 static const char bus_interface[] = "org.clightd.clightd.Sensor";
 static const sd_bus_vtable vtable[] = {
@@ -36,30 +60,65 @@ static bool evaluate(void) {
 }
 
 static void init(void) {
-    int r = sd_bus_add_object_vtable(bus,
-                                     NULL,
-                                     object_path,
-                                     bus_interface,
-                                     vtable,
-                                     NULL);
+    int r = stats_add_object_vtable(bus,
+                                    NULL,
+                                    object_path,
+                                    bus_interface,
+                                    vtable,
+                                    NULL);
     for (int i = ALS; i < SENSOR_NUM && !r; i++) {
         snprintf(sensors[i].obj_path, sizeof(sensors[i].obj_path) - 1, "%s/%s", object_path, sensors[i].name);
-        r += sd_bus_add_object_vtable(bus,
-                                     NULL,
-                                     sensors[i].obj_path,
-                                     bus_interface,
-                                     vtable,
-                                     NULL);
-        r += m_register_fd(sensor_get_monitor(i), false, &sensors[i]);
+        r += stats_add_object_vtable(bus,
+                                    NULL,
+                                    sensors[i].obj_path,
+                                    bus_interface,
+                                    vtable,
+                                    NULL);
+    }
+    if (r >= 0) {
+        r = lazy_register(object_path, start);
     }
     if (r < 0) {
         m_log("Failed to issue method call: %s\n", strerror(-r));
+        return;
+    }
+    
+    /* Monitors are registered right away, for Changed signals to be emitted even before any capture */
+    for (int i = ALS; i < SENSOR_NUM; i++) {
+        r += m_register_fd(sensor_get_monitor(i), false, &sensors[i]);
+    }
+    if (r < 0) {
+        m_log("Failed to register fds: %s\n", strerror(-r));
+    }
+}
+
+/* Called on first method call on Sensor objects, or on first capture requested by other modules */
+static void start(void) {
+    if (started) {
+        return;
+    }
+    started = true;
+    m_log("Starting.\n");
+    /* 
+     * Captures are run by a worker, not to block main loop.
+     * A single one is used as capture methods are not reentrant.
+     */
+    capture_pool = worker_pool_new(1);
+    if (capture_pool) {
+        int r = m_register_fd(worker_pool_get_fd(capture_pool), false, NULL);
+        if (r < 0) {
+            m_log("Failed to register fds: %s\n", strerror(-r));
+        }
     }
 }
 
 static void receive(const msg_t *msg, const void *userdata) {
     if (!msg->is_pubsub) {
         sensor_t *s = (sensor_t *)msg->fd_msg->userptr;
+        if (!s) {
+            worker_pool_dispatch(capture_pool);
+            return;
+        }
         struct udev_device *dev = NULL;
         sensor_receive_device(s, &dev);
         if (dev) {
@@ -72,6 +131,7 @@ static void receive(const msg_t *msg, const void *userdata) {
 }
 
 static void destroy(void) {
+    worker_pool_free(capture_pool);
     destroy_udev_monitors();
 }
 
@@ -168,10 +228,7 @@ static int method_issensoravailable(sd_bus_message *m, void *userdata, sd_bus_er
 }
 
 static int method_capturesensor(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-    if (!check_authorization(m)) {
-        sd_bus_error_set_errno(ret_error, EPERM);
-        return -EPERM;
-    }
+    ASSERT_AUTH(m, method_capturesensor, userdata, ret_error);
     
     const char *interface = NULL;
     char *settings = NULL;
@@ -187,51 +244,119 @@ static int method_capturesensor(sd_bus_message *m, void *userdata, sd_bus_error
         return -EINVAL;
     }
     
-    struct udev_device *dev = NULL;
-    double *pct = calloc(num_captures, sizeof(double));
-    if (pct) {
-        const char *member = sd_bus_message_get_path(m);
-        enum sensors s = get_sensor_type(member);
-    
-        // default value
-        r = -ENODEV;
-        if (s != SENSOR_NUM) {
-            if (is_sensor_available(&sensors[s], interface, &dev)) {
-                /* Bus Interface required sensor-specific method */
-                r = sensors[s].capture_method(dev, pct, num_captures, settings);
-            }
-        } else {
-            /* For CaptureSensor generic method, call capture_method on first available sensor */
-            for (s = 0; s < SENSOR_NUM; s++) {
-                if (is_sensor_available(&sensors[s], interface, &dev)) {
-                    r = sensors[s].capture_method(dev, pct, num_captures, settings);
-                    break;
-                }
-            }
-        }
-    } else {
-        r = -ENOMEM;
-    }
-    
-    /* No sensors available */
+    /* Method call is replied by on_bus_capture() */
+    sd_bus_message_ref(m);
+    stats_defer(m);
+    r = sensor_capture_async(sd_bus_message_get_path(m), interface, num_captures, settings, on_bus_capture, m);
     if (r < 0) {
+        sd_bus_message_unref(m);
         sd_bus_error_set_errno(ret_error, -r);
+        return r;
+    }
+    return 1;
+}
+
+static void on_bus_capture(const int r, const char *devnode, const double *pct, const int num_captures, void *userdata) {
+    sd_bus_message *m = (sd_bus_message *)userdata;
+    if (r < 0) {
+        sd_bus_reply_method_errno(m, -r, NULL);
     } else {
         /* Reply with array response */
         sd_bus_message *reply = NULL;
         sd_bus_message_new_method_return(m, &reply);
-        sd_bus_message_append(reply, "s", udev_device_get_devnode(dev));
+        sd_bus_message_append(reply, "s", devnode);
         sd_bus_message_append_array(reply, 'd', pct, num_captures * sizeof(double));
-        r = sd_bus_send(NULL, reply, NULL);
+        sd_bus_send(NULL, reply, NULL);
         sd_bus_message_unref(reply);
         
-        m_log("%d frames captured by %s.\n", num_captures, udev_device_get_devnode(dev));
+        m_log("%d frames captured by %s.\n", num_captures, devnode);
+    }
+    stats_reply(m, r < 0);
+    sd_bus_message_unref(m);
+}
+
+static sensor_t *find_sensor(enum sensors s, const char *interface, struct udev_device **dev) {
+    if (s != SENSOR_NUM) {
+        if (is_sensor_available(&sensors[s], interface, dev)) {
+            return &sensors[s];
+        }
+    } else {
+        /* For CaptureSensor generic method, use first available sensor */
+        for (s = 0; s < SENSOR_NUM; s++) {
+            if (is_sensor_available(&sensors[s], interface, dev)) {
+                return &sensors[s];
+            }
+        }
+    }
+    return NULL;
+}
+
+static void capture_work(void *data) {
+    capture_job *job = (capture_job *)data;
+    job->r = job->sensor->capture_method(job->devnode, job->syspath, job->pct, job->num_captures, job->settings);
+}
+
+static void on_capture_done(void *data) {
+    capture_job *job = (capture_job *)data;
+    job->cb(job->r, job->devnode, job->pct, job->num_captures, job->userdata);
+    free(job->devnode);
+    free(job->syspath);
+    free(job->settings);
+    free(job->pct);
+    free(job);
+}
+
+/* Module is being destroyed while capture is pending: cb is told it was cancelled */
+static void on_capture_cancel(void *data) {
+    capture_job *job = (capture_job *)data;
+    job->r = -ECANCELED;
+    on_capture_done(job);
+}
+
+/* 
+ * Capture from required sensor (eg: "Camera"), or from first available one if name is empty.
+ * Sensor is looked up right away, while capture is run by sensor worker:
+ * cb is called from main loop once it is done, unless an error is returned.
+ * Used by other modules to avoid going through the bus.
+ */
+int sensor_capture_async(const char *name, const char *interface, const int num_captures, 
+                         const char *settings, sensor_capture_cb cb, void *userdata) {
+    start();
+    
+    struct udev_device *dev = NULL;
+    sensor_t *sensor = find_sensor(get_sensor_type(name), interface, &dev);
+    if (!sensor) {
+        /* No sensors available */
+        return -ENODEV;
     }
     
-    /* Properly free dev if needed */
-    if (dev) {
-        udev_device_unref(dev);
+    capture_job *job = calloc(1, sizeof(capture_job));
+    if (job) {
+        const char *devnode = udev_device_get_devnode(dev);
+        job->devnode = strdup(devnode ? devnode : "");
+        job->syspath = strdup(udev_device_get_syspath(dev));
+        job->pct = calloc(num_captures, sizeof(double));
+        job->settings = strdup(settings);
     }
-    free(pct);
-    return r;
+    udev_device_unref(dev);
+    if (!job || !job->devnode || !job->syspath || !job->pct || !job->settings) {
+        if (job) {
+            free(job->devnode);
+            free(job->syspath);
+            free(job->pct);
+            free(job->settings);
+            free(job);
+        }
+        return -ENOMEM;
+    }
+    job->sensor = sensor;
+    job->num_captures = num_captures;
+    job->cb = cb;
+    job->userdata = userdata;
+    if (worker_pool_submit(capture_pool, "capture", capture_work, on_capture_done, on_capture_cancel, job) < 0) {
+        /* No worker: run it right away */
+        capture_work(job);
+        on_capture_done(job);
+    }
+    return 0;
 }
@@ -18,15 +18,19 @@ typedef struct _sensor {
     const char *subsystem;  // udev subsystem
     const char *udev_name;  // required udev name (used by als sensor that REQUIRES "acpi-als" name, as "iio" subsystem alone is not enough to identify it)
     int mon_handler;        // if an udev monitor is associated to this sensor, it will be != -1
-    int (*capture_method)(struct udev_device *userdata, double *pct, const int num_captures, char *settings);
+    int (*capture_method)(const char *devnode, const char *syspath, double *pct, const int num_captures, char *settings);    // run by a worker: no udev calls
     char obj_path[100];
 } sensor_t;
 
 #define SENSOR(type, subsystem, udev_name) \
-    static int capture(struct udev_device *dev, double *pct, const int num_captures, char *settings); \
+    static int capture(const char *devnode, const char *syspath, double *pct, const int num_captures, char *settings); \
     static void _ctor_ register_sensor(void) { \
         const sensor_t self = { type, subsystem, udev_name, -1, capture }; \
         sensor_register_new(&self); \
     }
 
+typedef void (*sensor_capture_cb)(const int r, const char *devnode, const double *pct, const int num_captures, void *userdata);
+
 void sensor_register_new(const sensor_t *sensor);
+int sensor_capture_async(const char *name, const char *interface, const int num_captures, 
+                         const char *settings, sensor_capture_cb cb, void *userdata);
@@ -1,4 +1,6 @@
 #include <sensor.h>
+#include <fcntl.h>
+#include <limits.h>
 
 #define ALS_NAME        "Als"
 #define ALS_ILL_MAX     4096
@@ -7,11 +9,28 @@
 
 SENSOR(ALS_NAME, ALS_SUBSYSTEM, ALS_SYSNAME);
 
-/* Settings string unused */
-static int capture(struct udev_device *dev, double *pct, const int num_captures, char *settings) {
-    for (int i = 0; i < num_captures; i++) {
-        int32_t illuminance = atoi(udev_device_get_sysattr_value(dev, "in_illuminance_input"));
-        pct[i] = (double)illuminance / ALS_ILL_MAX;
+/* 
+ * Settings string unused.
+ * Illuminance is read straight from sysfs, as libudev would cache it after first read.
+ */
+static int capture(const char *devnode, const char *syspath, double *pct, const int num_captures, char *settings) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/in_illuminance_input", syspath);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
     }
-    return 0;
+    
+    int r = 0;
+    for (int i = 0; i < num_captures && !r; i++) {
+        char val[32] = {0};
+        if (pread(fd, val, sizeof(val) - 1, 0) > 0) {
+            int32_t illuminance = atoi(val);
+            pct[i] = (double)illuminance / ALS_ILL_MAX;
+        } else {
+            r = -EIO;
+        }
+    }
+    close(fd);
+    return r;
 }
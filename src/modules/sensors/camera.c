@@ -4,6 +4,8 @@
 #include <sys/ioctl.h>
 #include <stdint.h>
 #include <sensor.h>
+#include <stats.h>
+#include <usdt.h>
 
 #define CAMERA_NAME                 "Camera"
 #define CAMERA_ILL_MAX              255
@@ -59,11 +61,11 @@ SENSOR(CAMERA_NAME, CAMERA_SUBSYSTEM, NULL);
 /*
  * Frame capturing method
  */
-static int capture(struct udev_device *dev, double *pct, const int num_captures, char *settings) {
+static int capture(const char *devnode, const char *syspath, double *pct, const int num_captures, char *settings) {
     state.num_captures = num_captures;
     state.brightness = pct;
     state.settings = settings;
-    int r = recv_frames(udev_device_get_devnode(dev));
+    int r = recv_frames(devnode);
     free_all();
     return -r;
 }
@@ -293,7 +295,11 @@ static void recv_frame(int i) {
     buf.memory = V4L2_MEMORY_MMAP;
     
     /* Dequeue the buffer */
-    if(-1 == xioctl(VIDIOC_DQBUF, &buf, true)) {
+    const uint64_t start = stats_now();
+    const int r = xioctl(VIDIOC_DQBUF, &buf, true);
+    const uint64_t us = stats_record_op(STATS_V4L2_DEQUEUE, start, r == -1);
+    USDT(camera__frame, i, buf.bytesused, us);
+    if (-1 == r) {
         perror("Retrieving Frame");
         return;
     }
@@ -313,6 +319,7 @@ static double compute_brightness(const unsigned int size) {
         brightness += state.buf.start[i];
     }
     brightness /= state.width * state.height;
+    USDT(camera__brightness, size, (int)brightness);
     return brightness;
 }
 
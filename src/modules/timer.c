@@ -0,0 +1,191 @@
+#include <commons.h>
+#include <time.h>
+
+/* Deadlines expiring within this slack from the earliest one are fired in the same wakeup */
+#define TIMER_SLACK_US      2000
+
+static uint64_t now_us(void);
+static void heap_swap(int i, int j);
+static void heap_sift_up(int i);
+static void heap_sift_down(int i);
+static void heap_remove(int i);
+static void rearm(void);
+
+static deadline_t **heap;
+static int heap_len;
+static int heap_size;
+static uint64_t curr_gen;
+static int timer_fd = -1;
+static bool started;
+
+MODULE("TIMER");
+
+static void module_pre_start(void) {
+    
+}
+
+static bool check(void) {
+    return true;
+}
+
+static bool evaluate(void) {
+    return true;
+}
+
+static void init(void) {
+    started = true;
+    /* Some deadline may have already been set by other modules */
+    rearm();
+}
+
+static void receive(const msg_t *msg, const void *userdata) {
+    if (!msg->is_pubsub) {
+        uint64_t t;
+        read(timer_fd, &t, sizeof(uint64_t));
+        
+        /* 
+         * Deadlines set by callbacks while dispatching belong to a new generation:
+         * they will be fired on next wakeup, even if they are already expired.
+         */
+        const uint64_t limit = now_us() + TIMER_SLACK_US;
+        const uint64_t gen = curr_gen++;
+        while (heap_len > 0 && heap[0]->expiry <= limit && heap[0]->gen <= gen) {
+            deadline_t *d = heap[0];
+            heap_remove(0);
+            /* Callback may free d or set it again */
+            d->cb(d);
+        }
+        rearm();
+    }
+}
+
+static void destroy(void) {
+    free(heap);
+    heap = NULL;
+    heap_len = heap_size = 0;
+}
+
+void deadline_init(deadline_t *d, void (*cb)(deadline_t *d), void *userdata) {
+    memset(d, 0, sizeof(deadline_t));
+    d->idx = -1;
+    d->cb = cb;
+    d->userdata = userdata;
+}
+
+/* Set (or move) deadline to expire in ms milliseconds; 0 means as soon as possible */
+void deadline_set(deadline_t *d, const uint64_t ms) {
+    const bool was_top = d->idx == 0;
+    
+    d->expiry = now_us() + ms * 1000;
+    d->gen = curr_gen;
+    if (d->idx == -1) {
+        if (heap_len == heap_size) {
+            const int size = heap_size ? heap_size * 2 : 16;
+            deadline_t **tmp = realloc(heap, size * sizeof(deadline_t *));
+            if (!tmp) {
+                m_log("Failed to allocate timer.\n");
+                return;
+            }
+            heap = tmp;
+            heap_size = size;
+        }
+        d->idx = heap_len++;
+        heap[d->idx] = d;
+    }
+    heap_sift_up(d->idx);
+    heap_sift_down(d->idx);
+    if (was_top || d->idx == 0) {
+        rearm();
+    }
+}
+
+void deadline_cancel(deadline_t *d) {
+    if (d->idx >= 0 && d->idx < heap_len && heap[d->idx] == d) {
+        const bool was_top = d->idx == 0;
+        heap_remove(d->idx);
+        if (was_top) {
+            rearm();
+        }
+    }
+    d->idx = -1;
+}
+
+/* Returns ms left before deadline expiry; 0 if it is not armed */
+uint64_t deadline_remaining(const deadline_t *d) {
+    if (d->idx == -1) {
+        return 0;
+    }
+    const uint64_t now = now_us();
+    return d->expiry > now ? (d->expiry - now) / 1000 : 0;
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void heap_swap(int i, int j) {
+    deadline_t *tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+    heap[i]->idx = i;
+    heap[j]->idx = j;
+}
+
+static void heap_sift_up(int i) {
+    while (i > 0 && heap[(i - 1) / 2]->expiry > heap[i]->expiry) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heap_sift_down(int i) {
+    for (;;) {
+        int min = i;
+        const int l = 2 * i + 1, r = 2 * i + 2;
+        if (l < heap_len && heap[l]->expiry < heap[min]->expiry) {
+            min = l;
+        }
+        if (r < heap_len && heap[r]->expiry < heap[min]->expiry) {
+            min = r;
+        }
+        if (min == i) {
+            break;
+        }
+        heap_swap(i, min);
+        i = min;
+    }
+}
+
+static void heap_remove(int i) {
+    heap[i]->idx = -1;
+    if (--heap_len > i) {
+        heap[i] = heap[heap_len];
+        heap[i]->idx = i;
+        heap_sift_up(i);
+        heap_sift_down(i);
+    }
+}
+
+/* Arm timerfd on earliest deadline, or disarm it if heap is empty */
+static void rearm(void) {
+    if (!started) {
+        return;
+    }
+    /* Timerfd is only created once first deadline is set */
+    if (timer_fd == -1) {
+        if (heap_len == 0) {
+            return;
+        }
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        m_register_fd(timer_fd, true, NULL);
+    }
+    
+    struct itimerspec timerValue = {{0}};
+    if (heap_len > 0) {
+        timerValue.it_value.tv_sec = heap[0]->expiry / 1000000;
+        timerValue.it_value.tv_nsec = 1000 * (heap[0]->expiry % 1000000);
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timerValue, NULL);
+}
@@ -0,0 +1,234 @@
+#include <coalesce.h>
+#include <stats.h>
+#include <module/map.h>
+
+/* An identical read-only method call being serviced, with any call that joined it meanwhile */
+typedef struct {
+    sd_bus_message *leader;     // call actually being serviced
+    sd_bus_message **waiters;   // calls to be replied together with leader
+    int num_waiters;
+} coalesced_call;
+
+static char *build_key(sd_bus_message *m);
+static int append_args(sd_bus_message *m, FILE *key);
+static bool take_call(sd_bus_message *m, coalesced_call *call);
+static void release_waiters(coalesced_call *call);
+static void free_call(void *data);
+
+static map_t *in_flight;        // call key -> coalesced_call
+
+/*
+ * Returns 1 if m joined an identical in-flight call, thus it must not be serviced,
+ * 0 if m is the first one: it is serviced as usual, and identical calls will join it until it is replied.
+ * On any error, 0 is returned: m will just be serviced on its own.
+ * Either way, m is replied by coalesce_send*() functions, that record its stats.
+ */
+int coalesce_join(sd_bus_message *m) {
+    stats_defer(m);
+    char *key = build_key(m);
+    if (!key) {
+        return 0;
+    }
+
+    int ret = 0;
+    coalesced_call *call = in_flight ? map_get(in_flight, key) : NULL;
+    if (call) {
+        sd_bus_message **tmp = realloc(call->waiters, sizeof(sd_bus_message *) * (call->num_waiters + 1));
+        if (tmp) {
+            call->waiters = tmp;
+            call->waiters[call->num_waiters++] = sd_bus_message_ref(m);
+            ret = 1;
+        }
+    } else {
+        if (!in_flight) {
+            in_flight = map_new(true, free_call);
+        }
+        call = calloc(1, sizeof(coalesced_call));
+        if (call && in_flight) {
+            call->leader = m;
+            map_put(in_flight, key, call);
+        } else {
+            free(call);
+        }
+    }
+    free(key);
+    return ret;
+}
+
+/*
+ * Send reply to m, and a copy of it to every call that joined m.
+ * sd_bus_send() seals reply, so that it can then be read back to be copied.
+ */
+int coalesce_send(sd_bus_message *m, sd_bus_message *reply) {
+    coalesced_call call;
+    const bool leader = take_call(m, &call);
+    int r = sd_bus_send(NULL, reply, NULL);
+    stats_reply(m, r < 0);
+    if (leader) {
+        for (int i = 0; i < call.num_waiters; i++) {
+            sd_bus_message *copy = NULL;
+            int copy_r = sd_bus_message_new_method_return(call.waiters[i], &copy);
+            if (copy_r >= 0) {
+                sd_bus_message_rewind(reply, true);
+                copy_r = sd_bus_message_copy(copy, reply, true);
+            }
+            if (copy_r >= 0) {
+                copy_r = sd_bus_send(NULL, copy, NULL);
+            }
+            sd_bus_message_unref(copy);
+            stats_reply(call.waiters[i], copy_r < 0);
+        }
+        release_waiters(&call);
+    }
+    return r;
+}
+
+int coalesce_send_error(sd_bus_message *m, const sd_bus_error *error) {
+    coalesced_call call;
+    const bool leader = take_call(m, &call);
+    int r = sd_bus_reply_method_error(m, error);
+    stats_reply(m, true);
+    if (leader) {
+        for (int i = 0; i < call.num_waiters; i++) {
+            sd_bus_reply_method_error(call.waiters[i], error);
+            stats_reply(call.waiters[i], true);
+        }
+        release_waiters(&call);
+    }
+    return r;
+}
+
+int coalesce_send_errno(sd_bus_message *m, const int error) {
+    coalesced_call call;
+    const bool leader = take_call(m, &call);
+    int r = sd_bus_reply_method_errno(m, error, NULL);
+    stats_reply(m, true);
+    if (leader) {
+        for (int i = 0; i < call.num_waiters; i++) {
+            sd_bus_reply_method_errno(call.waiters[i], error, NULL);
+            stats_reply(call.waiters[i], true);
+        }
+        release_waiters(&call);
+    }
+    return r;
+}
+
+/*
+ * Key is made of object path, interface, member and every argument.
+ * Message is rewound both before and after, so that it can still be read by its method.
+ */
+static char *build_key(sd_bus_message *m) {
+    char *key = NULL;
+    size_t size = 0;
+    FILE *f = open_memstream(&key, &size);
+    if (!f) {
+        return NULL;
+    }
+
+    fprintf(f, "%s %s.%s", sd_bus_message_get_path(m), sd_bus_message_get_interface(m),
+            sd_bus_message_get_member(m));
+    int r = sd_bus_message_rewind(m, true);
+    if (r >= 0) {
+        r = append_args(m, f);
+    }
+    sd_bus_message_rewind(m, true);
+    fclose(f);
+    if (r < 0) {
+        free(key);
+        key = NULL;
+    }
+    return key;
+}
+
+static int append_args(sd_bus_message *m, FILE *key) {
+    char type;
+    const char *contents;
+    int r;
+
+    while ((r = sd_bus_message_peek_type(m, &type, &contents)) > 0) {
+        switch (type) {
+            case SD_BUS_TYPE_ARRAY:
+            case SD_BUS_TYPE_STRUCT:
+            case SD_BUS_TYPE_VARIANT:
+            case SD_BUS_TYPE_DICT_ENTRY:
+                r = sd_bus_message_enter_container(m, type, contents);
+                if (r >= 0) {
+                    fprintf(key, " %c%s(", type, contents);
+                    r = append_args(m, key);
+                    fputc(')', key);
+                }
+                if (r >= 0) {
+                    r = sd_bus_message_exit_container(m);
+                }
+                break;
+            case SD_BUS_TYPE_STRING:
+            case SD_BUS_TYPE_OBJECT_PATH:
+            case SD_BUS_TYPE_SIGNATURE: {
+                const char *s = NULL;
+                r = sd_bus_message_read_basic(m, type, &s);
+                /* Length prefix keeps keys unambiguous whatever the strings content */
+                fprintf(key, " %zu:%s", strlen(s), s);
+                break;
+            }
+            case SD_BUS_TYPE_DOUBLE: {
+                double d;
+                r = sd_bus_message_read_basic(m, type, &d);
+                fprintf(key, " %a", d);
+                break;
+            }
+            default: {
+                /* Every other basic type fits in a 64 bits integer */
+                uint64_t u = 0;
+                r = sd_bus_message_read_basic(m, type, &u);
+                fprintf(key, " %c%lu", type, (unsigned long)u);
+                break;
+            }
+        }
+        if (r < 0) {
+            return r;
+        }
+    }
+    return r;
+}
+
+/* If m is a leader, remove it from in-flight calls, moving its waiters to call */
+static bool take_call(sd_bus_message *m, coalesced_call *call) {
+    if (!in_flight) {
+        return false;
+    }
+
+    bool found = false;
+    char *key = build_key(m);
+    if (key) {
+        coalesced_call *c = map_get(in_flight, key);
+        if (c && c->leader == m) {
+            /* Detach waiters, not to be released by map dtor */
+            *call = *c;
+            c->waiters = NULL;
+            c->num_waiters = 0;
+            map_remove(in_flight, key);
+            found = true;
+        }
+        free(key);
+    }
+    if (map_length(in_flight) == 0) {
+        map_free(in_flight);
+        in_flight = NULL;
+    }
+    return found;
+}
+
+static void release_waiters(coalesced_call *call) {
+    for (int i = 0; i < call->num_waiters; i++) {
+        sd_bus_message_unref(call->waiters[i]);
+    }
+    free(call->waiters);
+    call->waiters = NULL;
+    call->num_waiters = 0;
+}
+
+static void free_call(void *data) {
+    coalesced_call *call = (coalesced_call *)data;
+    release_waiters(call);
+    free(call);
+}
@@ -0,0 +1,19 @@
+#include <commons.h>
+
+/* 
+ * Read-only methods can call it, after reading their parameters:
+ * if an identical call (same object, method and arguments) is already being serviced,
+ * m is suspended and replied together with it. 
+ * Otherwise m is serviced as usual, but it must be replied through coalesce_send*() functions.
+ */
+#define COALESCE(m) \
+    do { \
+        if (coalesce_join(m) > 0) { \
+            return 1; \
+        } \
+    } while (0)
+
+int coalesce_join(sd_bus_message *m);
+int coalesce_send(sd_bus_message *m, sd_bus_message *reply);
+int coalesce_send_error(sd_bus_message *m, const sd_bus_error *error);
+int coalesce_send_errno(sd_bus_message *m, const int error);
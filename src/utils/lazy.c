@@ -0,0 +1,54 @@
+#include <lazy.h>
+
+/* A module whose initialization is deferred until its objects are first used */
+typedef struct {
+    const char *path;
+    void (*start)(void);
+    bool started;
+} lazy_module;
+
+static int on_message(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static bool is_below(const char *path, const char *prefix);
+
+static lazy_module *lazies;
+static int num_lazies;
+static sd_bus_slot *filter_slot;
+
+int lazy_register(const char *path, void (*start)(void)) {
+    /* Filters are run before any object callback: modules are started before dispatching message to them */
+    if (!filter_slot) {
+        int r = sd_bus_add_filter(bus, &filter_slot, on_message, NULL);
+        if (r < 0) {
+            /* Do not defer anything */
+            start();
+            return r;
+        }
+    }
+    
+    lazy_module *tmp = realloc(lazies, sizeof(lazy_module) * (num_lazies + 1));
+    if (!tmp) {
+        start();
+        return -ENOMEM;
+    }
+    lazies = tmp;
+    lazies[num_lazies++] = (lazy_module){ path, start, false };
+    return 0;
+}
+
+static int on_message(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    if (sd_bus_message_is_method_call(m, NULL, NULL)) {
+        const char *path = sd_bus_message_get_path(m);
+        for (int i = 0; i < num_lazies; i++) {
+            if (!lazies[i].started && is_below(path, lazies[i].path)) {
+                lazies[i].started = true;
+                lazies[i].start();
+            }
+        }
+    }
+    return 0;
+}
+
+static bool is_below(const char *path, const char *prefix) {
+    const size_t len = strlen(prefix);
+    return path && !strncmp(path, prefix, len) && (path[len] == '\0' || path[len] == '/');
+}
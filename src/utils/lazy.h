@@ -0,0 +1,8 @@
+#include <commons.h>
+
+/* 
+ * Modules can register their objects right away, but defer their actual initialization
+ * (udev monitors, workers, hardware detection) until a first method call
+ * is addressed to path, or to any object below it: start is then called, once.
+ */
+int lazy_register(const char *path, void (*start)(void));
@@ -1,40 +1,235 @@
 #include <polkit.h>
+#include <stats.h>
+#include <usdt.h>
+#include <module/map.h>
+#include <time.h>
 
-int check_authorization(sd_bus_message *m) {
-    int authorized = 0;
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    sd_bus_message *reply = NULL;
-    sd_bus_creds *c = sd_bus_message_get_creds(m);
+/* A method call suspended until polkit replies */
+typedef struct {
+    sd_bus_message *m;
+    sd_bus_message_handler_t method;
+    void *userdata;
+    char *busname;
+    char action_id[100];
+    uint64_t start;             // when CheckAuthorization was called, for stats
+} auth_request;
+
+/* Cached authorizations of a sender */
+typedef struct {
+    map_t *actions;             // action id -> expiry time, in ms
+    sd_bus_slot *slot;          // NameOwnerChanged match for this sender
+} sender_auth;
+
+static int on_authorization_reply(sd_bus_message *reply, void *userdata, sd_bus_error *ret_error);
+static int parse_authorization(sd_bus_message *reply, bool *temporary);
+static bool is_cached(const char *busname, const char *action_id);
+static void cache_authorization(const char *busname, const char *action_id);
+static void free_sender_auth(void *data);
+static int on_name_owner_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static uint64_t now_ms(void);
+
+/* 
+ * Positive authorizations cache: sender unique name -> sender_auth.
+ * Entries expire after conf.polkit_cache_ttl ms, and are dropped as soon as sender leaves the bus.
+ */
+static map_t *auth_cache;
+static sd_bus_message *authorized_msg;  // method call being dispatched again after polkit authorized it
+
+/*
+ * Returns 1 if m is authorized, 0 if it was suspended waiting for polkit reply, < 0 on error.
+ * CheckAuthorization is called asynchronously, so that main loop keeps serving everything else meanwhile.
+ */
+int check_authorization(sd_bus_message *m, sd_bus_message_handler_t method, void *userdata) {
+    if (m == authorized_msg) {
+        return 1;
+    }
     
+    sd_bus_creds *c = sd_bus_message_get_creds(m);
     const char *busname;
     int r = sd_bus_creds_get_unique_name(c, &busname);
     if (r < 0) {
         fprintf(stderr, "%s\n", strerror(-r));
-        goto end;
+        return r;
     }
     
     char action_id[100] = {0};
     snprintf(action_id, sizeof(action_id), "%s.%s", sd_bus_message_get_destination(m), sd_bus_message_get_member(m));
+    const bool cached = is_cached(busname, action_id);
+    USDT(polkit__check, busname, action_id, cached);
+    if (cached) {
+        return 1;
+    }
     
-    r = sd_bus_call_method(bus, "org.freedesktop.PolicyKit1", "/org/freedesktop/PolicyKit1/Authority",
-                           "org.freedesktop.PolicyKit1.Authority", "CheckAuthorization", &error, &reply,
-                           "(sa{sv})sa{ss}us", "system-bus-name", 1, "name", "s", busname, action_id, NULL, 0, "");
+    auth_request *req = calloc(1, sizeof(auth_request));
+    if (!req) {
+        return -ENOMEM;
+    }
+    req->busname = strdup(busname);
+    strncpy(req->action_id, action_id, sizeof(req->action_id) - 1);
+    req->method = method;
+    req->userdata = userdata;
+    req->start = stats_now();
+    r = sd_bus_call_method_async(bus, NULL, "org.freedesktop.PolicyKit1", "/org/freedesktop/PolicyKit1/Authority",
+                                 "org.freedesktop.PolicyKit1.Authority", "CheckAuthorization", 
+                                 on_authorization_reply, req,
+                                 "(sa{sv})sa{ss}us", "system-bus-name", 1, "name", "s", busname, action_id, NULL, 0, "");
     if (r < 0) {
-        fprintf(stderr, "%s\n", error.message);
+        fprintf(stderr, "%s\n", strerror(-r));
+        free(req->busname);
+        free(req);
+        return r;
+    }
+    req->m = sd_bus_message_ref(m);
+    stats_defer(m);
+    return 0;
+}
+
+static int on_authorization_reply(sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
+    auth_request *req = (auth_request *)userdata;
+    
+    int authorized = 0;
+    const sd_bus_error *e = sd_bus_message_get_error(reply);
+    const uint64_t us = stats_record_op(STATS_POLKIT_CHECK, req->start, e != NULL);
+    if (e) {
+        fprintf(stderr, "%s\n", e->message);
     } else {
-        /* only read first boolean -> complete signature is "bba{ss}" but we only need first (authorized boolean) */
-        r = sd_bus_message_read(reply, "(bba{ss})", &authorized, NULL, NULL);
-        if (r < 0) {
-            fprintf(stderr, "%s\n", strerror(-r));
+        bool temporary = false;
+        authorized = parse_authorization(reply, &temporary);
+        if (authorized && !temporary) {
+            cache_authorization(req->busname, req->action_id);
         }
     }
     
-end:
-    if (reply) {
-        sd_bus_message_unref(reply);
-    }
-    if (error.message) {
+    USDT(polkit__reply, req->busname, req->action_id, authorized, us);
+    if (authorized) {
+        /* Dispatch method again, from the start */
+        sd_bus_error error = SD_BUS_ERROR_NULL;
+        sd_bus_message_rewind(req->m, true);
+        authorized_msg = req->m;
+        int r = stats_redispatch(req->m, req->method, req->userdata, &error);
+        authorized_msg = NULL;
+        if (sd_bus_error_is_set(&error)) {
+            sd_bus_reply_method_error(req->m, &error);
+        } else if (r < 0) {
+            sd_bus_reply_method_errno(req->m, -r, NULL);
+        }
         sd_bus_error_free(&error);
+    } else {
+        sd_bus_reply_method_errno(req->m, EPERM, NULL);
+        stats_reply(req->m, true);
+    }
+    sd_bus_message_unref(req->m);
+    free(req->busname);
+    free(req);
+    return 0;
+}
+
+/* Returns whether reply is a positive authorization; temporary is set for temporary ones */
+static int parse_authorization(sd_bus_message *reply, bool *temporary) {
+    /* Complete signature is "(bba{ss})": is_authorized, is_challenge, details */
+    int authorized = 0, challenge = 0;
+    int r = sd_bus_message_enter_container(reply, SD_BUS_TYPE_STRUCT, "bba{ss}");
+    if (r >= 0) {
+        r = sd_bus_message_read(reply, "bb", &authorized, &challenge);
+    }
+    if (r >= 0) {
+        r = sd_bus_message_enter_container(reply, SD_BUS_TYPE_ARRAY, "{ss}");
+    }
+    if (r >= 0) {
+        const char *key = NULL, *val = NULL;
+        while ((r = sd_bus_message_read(reply, "{ss}", &key, &val)) > 0) {
+            /* Temporary authorizations are tracked (and possibly revoked) by polkit itself */
+            if (!strcmp(key, "polkit.temporary_authorization_id")) {
+                *temporary = true;
+            }
+        }
+    }
+    if (r < 0) {
+        fprintf(stderr, "%s\n", strerror(-r));
+        return 0;
     }
     return authorized;
 }
+
+static bool is_cached(const char *busname, const char *action_id) {
+    sender_auth *s = auth_cache ? map_get(auth_cache, busname) : NULL;
+    uint64_t *expiry = s ? map_get(s->actions, action_id) : NULL;
+    if (expiry) {
+        if (*expiry > now_ms()) {
+            return true;
+        }
+        map_remove(s->actions, action_id);
+        if (map_length(s->actions) == 0) {
+            map_remove(auth_cache, busname);
+        }
+    }
+    return false;
+}
+
+static void cache_authorization(const char *busname, const char *action_id) {
+    if (conf.polkit_cache_ttl == 0) {
+        return;
+    }
+    
+    if (!auth_cache) {
+        auth_cache = map_new(true, free_sender_auth);
+        if (!auth_cache) {
+            return;
+        }
+    }
+    
+    sender_auth *s = map_get(auth_cache, busname);
+    if (!s) {
+        s = calloc(1, sizeof(sender_auth));
+        if (!s) {
+            return;
+        }
+        s->actions = map_new(true, free);
+        
+        /* Drop cached authorizations of sender as soon as it leaves the bus */
+        char match[256];
+        snprintf(match, sizeof(match), 
+                 "type='signal',sender='org.freedesktop.DBus',interface='org.freedesktop.DBus',"
+                 "member='NameOwnerChanged',arg0='%s'", busname);
+        if (!s->actions || sd_bus_add_match(bus, &s->slot, match, on_name_owner_changed, NULL) < 0) {
+            free_sender_auth(s);
+            return;
+        }
+        map_put(auth_cache, busname, s);
+    }
+    
+    /* Renewed authorizations only get their expiry updated */
+    uint64_t *expiry = map_get(s->actions, action_id);
+    if (!expiry) {
+        expiry = malloc(sizeof(uint64_t));
+        if (!expiry) {
+            return;
+        }
+        map_put(s->actions, action_id, expiry);
+    }
+    *expiry = now_ms() + conf.polkit_cache_ttl;
+}
+
+static void free_sender_auth(void *data) {
+    sender_auth *s = (sender_auth *)data;
+    sd_bus_slot_unref(s->slot);
+    if (s->actions) {
+        map_free(s->actions);
+    }
+    free(s);
+}
+
+static int on_name_owner_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    const char *name = NULL, *old_owner = NULL, *new_owner = NULL;
+    if (sd_bus_message_read(m, "sss", &name, &old_owner, &new_owner) >= 0 && !strlen(new_owner)) {
+        /* Its match slot is released too */
+        map_remove(auth_cache, name);
+    }
+    return 0;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
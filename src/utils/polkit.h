@@ -1,4 +1,20 @@
 #include <commons.h>
 
-int check_authorization(sd_bus_message *m);
+/* 
+ * Privileged methods must call it before reading any parameter:
+ * either m is already authorized, or method is suspended until polkit replies; 
+ * then it is called again with m if authorized, otherwise m is replied with EPERM.
+ */
+#define ASSERT_AUTH(m, method, userdata, ret_error) \
+    do { \
+        int auth_r = check_authorization(m, method, userdata); \
+        if (auth_r < 0) { \
+            sd_bus_error_set_errno(ret_error, -auth_r); \
+            return auth_r; \
+        } \
+        if (auth_r == 0) { \
+            return 1; \
+        } \
+    } while (0)
 
+int check_authorization(sd_bus_message *m, sd_bus_message_handler_t method, void *userdata);
@@ -0,0 +1,299 @@
+#include <stats.h>
+#include <usdt.h>
+#include <module/map.h>
+#include <time.h>
+
+/* A bus method, whose handler is wrapped to be timed */
+typedef struct {
+    char name[128];             // "interface.member"
+    sd_bus_message_handler_t handler;
+    stats_t stats;
+} method_stats;
+
+/* A method call being serviced: it is recorded once replied */
+typedef struct {
+    method_stats *ms;
+    sd_bus_message *m;          // deferred calls hold a ref, for their address not to be reused
+    uint64_t start;
+    bool deferred;              // handler returned without replying: stats_reply() records it
+    bool error;                 // m was replied with an error by its handler
+} method_call;
+
+static int on_method_call(method_stats *ms, sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+static int dispatch(method_call *call, sd_bus_message_handler_t handler, void *userdata, sd_bus_error *ret_error);
+static void record_call(const method_call *call, const int r);
+static void free_deferred_call(void *data);
+static int append_stats(sd_bus_message *reply, const char *name, const stats_t *s);
+static void reset_stats(stats_t *s);
+
+/*
+ * sd-bus does not tell handlers which vtable entry they are called for:
+ * each wrapped method gets its own trampoline, that knows its slot in methods array.
+ */
+#define _TRAMPOLINES \
+    X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15) \
+    X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23) X(24) X(25) X(26) X(27) X(28) X(29) X(30) X(31) \
+    X(32) X(33) X(34) X(35) X(36) X(37) X(38) X(39) X(40) X(41) X(42) X(43) X(44) X(45) X(46) X(47) \
+    X(48) X(49) X(50) X(51) X(52) X(53) X(54) X(55) X(56) X(57) X(58) X(59) X(60) X(61) X(62) X(63)
+
+#define MAX_METHODS 64
+
+static method_stats methods[MAX_METHODS];   // wrapped methods, by trampoline slot
+static int num_methods;
+
+#define X(i) \
+    static int on_method_call_##i(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) { \
+        return on_method_call(&methods[i], m, userdata, ret_error); \
+    }
+    _TRAMPOLINES
+#undef X
+
+static const sd_bus_message_handler_t trampolines[] = {
+#define X(i) on_method_call_##i,
+    _TRAMPOLINES
+#undef X
+};
+
+static const char *op_names[] = {
+#define X(op, name) name,
+    _STATS_OPS
+#undef X
+};
+
+static map_t *vtables;                      // original vtable address -> wrapped copy
+static map_t *deferred_calls;               // method call address -> referenced method_call, until replied
+static method_call *current;                // method call whose handler is running
+static stats_t ops[STATS_OPS_NUM];          // updated from workers too: only touched through atomics
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Lock-free, as it is called from workers too; cheap enough to be always enabled.
+ * Returns elapsed us.
+ */
+uint64_t stats_record(stats_t *s, const uint64_t start_us, const bool error) {
+    const uint64_t us = stats_now() - start_us;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= STATS_BUCKETS) {
+        bucket = STATS_BUCKETS - 1;
+    }
+
+    __atomic_add_fetch(&s->count, 1, __ATOMIC_RELAXED);
+    if (error) {
+        __atomic_add_fetch(&s->errors, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&s->total_us, us, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->buckets[bucket], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&s->max_us, __ATOMIC_RELAXED);
+    while (us > max && !__atomic_compare_exchange_n(&s->max_us, &max, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return us;
+}
+
+uint64_t stats_record_op(const enum stats_ops op, const uint64_t start_us, const bool error) {
+    if (op < STATS_OPS_NUM) {
+        return stats_record(&ops[op], start_us, error);
+    }
+    return 0;
+}
+
+/*
+ * Same as sd_bus_add_object_vtable(), but every method handler is wrapped by a trampoline,
+ * that keeps its calls, errors and latencies (from call receipt until its reply is sent).
+ * Wrapped vtable copies are kept for the whole daemon lifetime, as original vtables are.
+ */
+int stats_add_object_vtable(sd_bus *b, sd_bus_slot **slot, const char *path, const char *interface,
+                            const sd_bus_vtable *vtable, void *userdata) {
+    if (!vtables) {
+        vtables = map_new(true, free);
+    }
+
+    char vt_key[32];
+    snprintf(vt_key, sizeof(vt_key), "%p", (void *)vtable);
+    sd_bus_vtable *wrapped = vtables ? map_get(vtables, vt_key) : NULL;
+    if (!wrapped && vtables) {
+        int len = 0;
+        while (vtable[len++].type != _SD_BUS_VTABLE_END);
+
+        wrapped = malloc(sizeof(sd_bus_vtable) * len);
+        if (!wrapped) {
+            return -ENOMEM;
+        }
+        memcpy(wrapped, vtable, sizeof(sd_bus_vtable) * len);
+        for (int i = 0; i < len; i++) {
+            if (wrapped[i].type != _SD_BUS_VTABLE_METHOD) {
+                continue;
+            }
+            if (num_methods == MAX_METHODS) {
+                /* Out of trampolines: method is just not tracked */
+                fprintf(stderr, "No stats for %s.%s.\n", interface, wrapped[i].x.method.member);
+                continue;
+            }
+            method_stats *ms = &methods[num_methods];
+            snprintf(ms->name, sizeof(ms->name), "%s.%s", interface, wrapped[i].x.method.member);
+            ms->handler = wrapped[i].x.method.handler;
+            wrapped[i].x.method.handler = trampolines[num_methods++];
+        }
+        map_put(vtables, vt_key, wrapped);
+    }
+    return sd_bus_add_object_vtable(b, slot, path, interface, wrapped ? wrapped : vtable, userdata);
+}
+
+/*
+ * To be called by handlers returning before m is replied (eg: waiting for a worker):
+ * its latency and error are then recorded by stats_reply().
+ */
+void stats_defer(sd_bus_message *m) {
+    if (current && current->m == m) {
+        current->deferred = true;
+    }
+}
+
+/* To be called whenever a method call that may have been deferred is replied */
+void stats_reply(sd_bus_message *m, const bool error) {
+    if (current && current->m == m) {
+        /* Replied by its handler itself */
+        current->deferred = false;
+        current->error |= error;
+        return;
+    }
+
+    char key[32];
+    snprintf(key, sizeof(key), "%p", (void *)m);
+    method_call *call = deferred_calls ? map_get(deferred_calls, key) : NULL;
+    if (call) {
+        record_call(call, error ? -1 : 0);
+        map_remove(deferred_calls, key);
+    }
+}
+
+/*
+ * Call handler again for deferred m (eg: once polkit authorized it):
+ * m is still recorded from its first dispatch, once replied.
+ */
+int stats_redispatch(sd_bus_message *m, sd_bus_message_handler_t handler, void *userdata, sd_bus_error *ret_error) {
+    char key[32];
+    snprintf(key, sizeof(key), "%p", (void *)m);
+    method_call *deferred = deferred_calls ? map_get(deferred_calls, key) : NULL;
+    if (!deferred) {
+        return handler(m, userdata, ret_error);
+    }
+
+    /* Caller still holds m */
+    method_call call = *deferred;
+    call.deferred = false;
+    map_remove(deferred_calls, key);
+    return dispatch(&call, handler, userdata, ret_error);
+}
+
+int stats_append_methods(sd_bus_message *reply) {
+    int r = sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "(sttttat)");
+    for (int i = 0; i < num_methods && r >= 0; i++) {
+        r = append_stats(reply, methods[i].name, &methods[i].stats);
+    }
+    if (r >= 0) {
+        r = sd_bus_message_close_container(reply);
+    }
+    return r;
+}
+
+int stats_append_ops(sd_bus_message *reply) {
+    int r = sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "(sttttat)");
+    for (int i = 0; i < STATS_OPS_NUM && r >= 0; i++) {
+        r = append_stats(reply, op_names[i], &ops[i]);
+    }
+    if (r >= 0) {
+        r = sd_bus_message_close_container(reply);
+    }
+    return r;
+}
+
+void stats_reset(void) {
+    for (int i = 0; i < num_methods; i++) {
+        reset_stats(&methods[i].stats);
+    }
+    for (int i = 0; i < STATS_OPS_NUM; i++) {
+        reset_stats(&ops[i]);
+    }
+}
+
+static int on_method_call(method_stats *ms, sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    USDT(method__entry, ms->name, sd_bus_message_get_sender(m));
+    method_call call = { ms, m, stats_now(), false, false };
+    return dispatch(&call, ms->handler, userdata, ret_error);
+}
+
+/* Run handler for call: it is recorded right away, unless it was deferred */
+static int dispatch(method_call *call, sd_bus_message_handler_t handler, void *userdata, sd_bus_error *ret_error) {
+    method_call *prev = current;
+    current = call;
+    int r = handler(call->m, userdata, ret_error);
+    current = prev;
+
+    /* Handlers returning an error are replied by sd-bus */
+    if (!call->deferred || r < 0) {
+        record_call(call, call->error ? -1 : r);
+        return r;
+    }
+
+    if (!deferred_calls) {
+        deferred_calls = map_new(true, free_deferred_call);
+    }
+    method_call *deferred = malloc(sizeof(method_call));
+    if (deferred && deferred_calls) {
+        char key[32];
+        snprintf(key, sizeof(key), "%p", (void *)call->m);
+        *deferred = *call;
+        deferred->m = sd_bus_message_ref(call->m);
+        map_put(deferred_calls, key, deferred);
+    } else {
+        free(deferred);
+    }
+    return r;
+}
+
+static void record_call(const method_call *call, const int r) {
+    const uint64_t us = stats_record(&call->ms->stats, call->start, r < 0);
+    USDT(method__return, call->ms->name, r, us);
+}
+
+static void free_deferred_call(void *data) {
+    method_call *call = (method_call *)data;
+    sd_bus_message_unref(call->m);
+    free(call);
+}
+
+static int append_stats(sd_bus_message *reply, const char *name, const stats_t *s) {
+    int r = sd_bus_message_open_container(reply, SD_BUS_TYPE_STRUCT, "sttttat");
+    if (r >= 0) {
+        r = sd_bus_message_append(reply, "stttt", name,
+                                  __atomic_load_n(&s->count, __ATOMIC_RELAXED),
+                                  __atomic_load_n(&s->errors, __ATOMIC_RELAXED),
+                                  __atomic_load_n(&s->total_us, __ATOMIC_RELAXED),
+                                  __atomic_load_n(&s->max_us, __ATOMIC_RELAXED));
+    }
+    if (r >= 0) {
+        uint64_t buckets[STATS_BUCKETS];
+        for (int i = 0; i < STATS_BUCKETS; i++) {
+            buckets[i] = __atomic_load_n(&s->buckets[i], __ATOMIC_RELAXED);
+        }
+        r = sd_bus_message_append_array(reply, 't', buckets, sizeof(buckets));
+    }
+    if (r >= 0) {
+        r = sd_bus_message_close_container(reply);
+    }
+    return r;
+}
+
+static void reset_stats(stats_t *s) {
+    __atomic_store_n(&s->count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->errors, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->total_us, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->max_us, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        __atomic_store_n(&s->buckets[i], 0, __ATOMIC_RELAXED);
+    }
+}
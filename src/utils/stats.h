@@ -0,0 +1,44 @@
+#include <commons.h>
+
+/* Operations underlying bus methods, tracked by Stats interface */
+#define _STATS_OPS \
+    X(STATS_SYSFS_WRITE, "SysfsWrite") \
+    X(STATS_DDC_READ, "DdcRead") \
+    X(STATS_DDC_WRITE, "DdcWrite") \
+    X(STATS_V4L2_DEQUEUE, "V4l2Dequeue") \
+    X(STATS_X_CALL, "XCall") \
+    X(STATS_POLKIT_CHECK, "PolkitCheck")
+
+enum stats_ops {
+#define X(op, name) op,
+    _STATS_OPS
+#undef X
+    STATS_OPS_NUM
+};
+
+/* Bucket 0 holds latencies < 1us, bucket i holds [2^(i-1), 2^i) us; last one holds anything longer */
+#define STATS_BUCKETS 24
+
+typedef struct {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t buckets[STATS_BUCKETS];
+} stats_t;
+
+uint64_t stats_now(void);
+uint64_t stats_record(stats_t *s, const uint64_t start_us, const bool error);
+uint64_t stats_record_op(const enum stats_ops op, const uint64_t start_us, const bool error);
+int stats_add_object_vtable(sd_bus *b, sd_bus_slot **slot, const char *path, const char *interface,
+                            const sd_bus_vtable *vtable, void *userdata);
+int stats_append_methods(sd_bus_message *reply);
+int stats_append_ops(sd_bus_message *reply);
+void stats_reset(void);
+/*
+ * Method latencies span from call receipt to its reply: handlers replying later (eg: once a worker is done)
+ * must call stats_defer() before returning, and stats_reply() once m is replied.
+ */
+void stats_defer(sd_bus_message *m);
+void stats_reply(sd_bus_message *m, const bool error);
+int stats_redispatch(sd_bus_message *m, sd_bus_message_handler_t handler, void *userdata, sd_bus_error *ret_error);
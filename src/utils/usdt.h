@@ -0,0 +1,21 @@
+#pragma once
+
+/* 
+ * USDT static probes, enabled with -DENABLE_USDT=ON: they are nops until a tracer attaches them, eg:
+ *   # bpftrace -e 'usdt:/usr/lib/clightd/clightd:clightd:method__return { @[str(arg0)] = hist(arg2); }'
+ * Arguments are integers or strings; pcts are passed as per-mille values.
+ */
+#ifdef USDT_PRESENT
+
+#include <sys/sdt.h>
+
+#define USDT(name, ...) STAP_PROBEV(clightd, name, ##__VA_ARGS__)
+
+#else
+
+/* Arguments are never evaluated, but still referenced: no unused variables warnings when disabled */
+static inline void usdt_disabled(int unused, ...) { }
+
+#define USDT(name, ...) do { if (0) { usdt_disabled(0, ##__VA_ARGS__); } } while (0)
+
+#endif
@@ -0,0 +1,213 @@
+#include <worker.h>
+#include <module/map.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+/*
+ * Small pool of worker threads, used to run blocking operations off the main loop.
+ * Jobs submitted with same key are always run by the same worker, in submission order:
+ * this gives at most one in-flight operation per key (eg: per display),
+ * while jobs with different keys run in parallel.
+ * Once a job is completed, its done callback is called from main loop, 
+ * by worker_pool_dispatch(), when pool eventfd gets readable.
+ * Jobs still pending when pool is freed get their cancel callback called instead.
+ */
+
+typedef struct _job {
+    void (*work)(void *data);   // called from worker thread
+    void (*done)(void *data);   // called from main loop, once work is completed
+    void (*cancel)(void *data); // called by worker_pool_free() instead of done, if still pending
+    void *data;
+    struct _job *next;
+} job_t;
+
+typedef struct {
+    pthread_t thread;
+    pthread_cond_t cond;
+    job_t *head, *tail;         // queued jobs
+    worker_pool_t *pool;
+} worker_t;
+
+struct _worker_pool {
+    pthread_mutex_t mtx;
+    worker_t *workers;
+    int num_workers;
+    int next_worker;            // round-robin index for new keys
+    map_t *keys;                // key -> assigned worker
+    job_t *done_head, *done_tail;
+    bool quit;
+    int efd;
+};
+
+static void *worker_loop(void *arg);
+static void push_job(job_t **head, job_t **tail, job_t *j);
+static void cancel_jobs(job_t *j);
+
+worker_pool_t *worker_pool_new(const int num_workers) {
+    worker_pool_t *pool = calloc(1, sizeof(worker_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+    
+    pool->workers = calloc(num_workers, sizeof(worker_t));
+    pool->keys = map_new(true, NULL);
+    pool->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_init(&pool->mtx, NULL);
+    if (!pool->workers || !pool->keys || pool->efd == -1) {
+        worker_pool_free(pool);
+        return NULL;
+    }
+    
+    for (int i = 0; i < num_workers; i++) {
+        worker_t *w = &pool->workers[i];
+        w->pool = pool;
+        pthread_cond_init(&w->cond, NULL);
+        if (pthread_create(&w->thread, NULL, worker_loop, w) != 0) {
+            pthread_cond_destroy(&w->cond);
+            break;
+        }
+        pool->num_workers++;
+    }
+    if (pool->num_workers == 0) {
+        worker_pool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+int worker_pool_get_fd(const worker_pool_t *pool) {
+    return pool ? pool->efd : -1;
+}
+
+int worker_pool_submit(worker_pool_t *pool, const char *key, void (*work)(void *data), 
+                       void (*done)(void *data), void (*cancel)(void *data), void *data) {
+    if (!pool) {
+        return -EINVAL;
+    }
+    
+    job_t *j = calloc(1, sizeof(job_t));
+    if (!j) {
+        return -ENOMEM;
+    }
+    j->work = work;
+    j->done = done;
+    j->cancel = cancel;
+    j->data = data;
+    
+    pthread_mutex_lock(&pool->mtx);
+    worker_t *w = key ? map_get(pool->keys, key) : NULL;
+    if (!w) {
+        w = &pool->workers[pool->next_worker];
+        pool->next_worker = (pool->next_worker + 1) % pool->num_workers;
+        if (key) {
+            map_put(pool->keys, key, w);
+        }
+    }
+    push_job(&w->head, &w->tail, j);
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&pool->mtx);
+    return 0;
+}
+
+/* To be called from main loop when pool eventfd is readable */
+void worker_pool_dispatch(worker_pool_t *pool) {
+    uint64_t t;
+    read(pool->efd, &t, sizeof(uint64_t));
+    
+    pthread_mutex_lock(&pool->mtx);
+    job_t *j = pool->done_head;
+    pool->done_head = pool->done_tail = NULL;
+    pthread_mutex_unlock(&pool->mtx);
+    
+    while (j) {
+        job_t *next = j->next;
+        if (j->done) {
+            j->done(j->data);
+        }
+        free(j);
+        j = next;
+    }
+}
+
+/*
+ * Join workers once they completed their running job, if any.
+ * Done callbacks are not called anymore: jobs still queued, or completed but not yet dispatched,
+ * get their cancel callback called from here instead, to release their data.
+ */
+void worker_pool_free(worker_pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+    
+    pthread_mutex_lock(&pool->mtx);
+    pool->quit = true;
+    for (int i = 0; i < pool->num_workers; i++) {
+        pthread_cond_signal(&pool->workers[i].cond);
+    }
+    pthread_mutex_unlock(&pool->mtx);
+    
+    for (int i = 0; i < pool->num_workers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        pthread_cond_destroy(&pool->workers[i].cond);
+        cancel_jobs(pool->workers[i].head);
+    }
+    cancel_jobs(pool->done_head);
+    free(pool->workers);
+    if (pool->keys) {
+        map_free(pool->keys);
+    }
+    if (pool->efd != -1) {
+        close(pool->efd);
+    }
+    pthread_mutex_destroy(&pool->mtx);
+    free(pool);
+}
+
+static void *worker_loop(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    worker_pool_t *pool = w->pool;
+    
+    pthread_mutex_lock(&pool->mtx);
+    while (!pool->quit) {
+        job_t *j = w->head;
+        if (!j) {
+            pthread_cond_wait(&w->cond, &pool->mtx);
+            continue;
+        }
+        w->head = j->next;
+        if (!w->head) {
+            w->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->mtx);
+        
+        j->work(j->data);
+        
+        pthread_mutex_lock(&pool->mtx);
+        push_job(&pool->done_head, &pool->done_tail, j);
+        uint64_t one = 1;
+        write(pool->efd, &one, sizeof(uint64_t));
+    }
+    pthread_mutex_unlock(&pool->mtx);
+    return NULL;
+}
+
+static void push_job(job_t **head, job_t **tail, job_t *j) {
+    j->next = NULL;
+    if (*tail) {
+        (*tail)->next = j;
+    } else {
+        *head = j;
+    }
+    *tail = j;
+}
+
+static void cancel_jobs(job_t *j) {
+    while (j) {
+        job_t *next = j->next;
+        if (j->cancel) {
+            j->cancel(j->data);
+        }
+        free(j);
+        j = next;
+    }
+}
@@ -0,0 +1,10 @@
+#include <commons.h>
+
+typedef struct _worker_pool worker_pool_t;
+
+worker_pool_t *worker_pool_new(const int num_workers);
+int worker_pool_get_fd(const worker_pool_t *pool);
+int worker_pool_submit(worker_pool_t *pool, const char *key, void (*work)(void *data), 
+                       void (*done)(void *data), void (*cancel)(void *data), void *data);
+void worker_pool_dispatch(worker_pool_t *pool);
+void worker_pool_free(worker_pool_t *pool);
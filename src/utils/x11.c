@@ -0,0 +1,73 @@
+#if defined GAMMA_PRESENT || defined DPMS_PRESENT || defined SCREEN_PRESENT
+
+#include <x11.h>
+#include <pthread.h>
+#include <X11/Xauth.h>
+
+static void init_x11_threads(void);
+static Xauth *read_xauth(const char *display, const char *xauthority);
+
+static pthread_once_t x11_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t xauth_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void init_x11_threads(void) {
+    XInitThreads();
+}
+
+/* 
+ * Open display using xauthority cookie.
+ * X modules open displays from their own workers: environment is never touched,
+ * as getenv() may run concurrently; cookie is read from xauthority file instead,
+ * and handed to Xlib through XSetAuthorization(), that is process-wide too:
+ * it is only set for the duration of XOpenDisplay(), under xauth_mtx.
+ */
+Display *x11_open_display(const char *display, const char *xauthority) {
+    pthread_once(&x11_once, init_x11_threads);
+    
+    Xauth *auth = read_xauth(display, xauthority);
+    pthread_mutex_lock(&xauth_mtx);
+    if (auth) {
+        XSetAuthorization(auth->name, auth->name_length, auth->data, auth->data_length);
+    }
+    Display *dpy = XOpenDisplay(display);
+    /* Restore default authorization */
+    XSetAuthorization(NULL, 0, NULL, 0);
+    pthread_mutex_unlock(&xauth_mtx);
+    if (auth) {
+        XauDisposeAuth(auth);
+    }
+    return dpy;
+}
+
+/* Returns first MIT-MAGIC-COOKIE-1 entry of xauthority file for display number, if any */
+static Xauth *read_xauth(const char *display, const char *xauthority) {
+    static const char cookie_name[] = "MIT-MAGIC-COOKIE-1";
+    
+    if (!xauthority || !strlen(xauthority)) {
+        return NULL;
+    }
+    FILE *f = fopen(xauthority, "r");
+    if (!f) {
+        return NULL;
+    }
+    
+    /* Display number is what follows ':', up to screen number, if any */
+    const char *num = display ? strrchr(display, ':') : NULL;
+    const size_t num_len = num ? strcspn(++num, ".") : 0;
+    
+    Xauth *auth = NULL;
+    while (!auth && (auth = XauReadAuth(f))) {
+        const bool is_cookie = auth->name_length == strlen(cookie_name) && 
+                               !memcmp(auth->name, cookie_name, auth->name_length);
+        const bool is_display = !num || 
+                               (auth->number_length == num_len && !memcmp(auth->number, num, num_len));
+        if (!is_cookie || !is_display) {
+            XauDisposeAuth(auth);
+            auth = NULL;
+        }
+    }
+    fclose(f);
+    return auth;
+}
+
+#endif
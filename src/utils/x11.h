@@ -0,0 +1,4 @@
+#include <commons.h>
+#include <X11/Xlib.h>
+
+Display *x11_open_display(const char *display, const char *xauthority);